@@ -0,0 +1,475 @@
+;;; -*- lexical-binding: t -*-
+
+;; Benchmarks for the GSSAPI module. This file is normally loaded by
+;; run.sh, which provisions a local KDC and sets GSS_BENCH_SERVICE and
+;; GSS_BENCH_KEYTAB before starting Emacs in batch mode. The results
+;; are printed as a single JSON object.
+
+(require 'cl)
+(require 'json)
+(require 'gss)
+
+(defvar gss-bench-handshake-iterations 200)
+(defvar gss-bench-payload-sizes '(16 256 4096 65536 1048576 16777216))
+(defvar gss-bench-bytes-per-size (* 64 1024 1024))
+(defvar gss-bench-call-iterations 10000)
+(defvar gss-bench-batch-sizes '(100 1000))
+
+(defmacro gss-bench--elapsed (&rest body)
+  (let ((start (make-symbol "start")))
+    `(let ((,start (float-time)))
+       ,@body
+       (- (float-time) ,start))))
+
+(defun gss-bench--establish (&optional cred)
+  "Establish a context pair and return it as (INITIATOR . ACCEPTOR).
+CRED is the initiator credential, or nil for the default."
+  (let ((service (getenv "GSS_BENCH_SERVICE"))
+        (initiator nil)
+        (acceptor nil)
+        (token nil)
+        (continue t))
+    (while continue
+      (destructuring-bind (init-continue context output _flags)
+          (gss-init-sec-context service
+                                :flags (list :mutual :conf :integ)
+                                :context initiator
+                                :input-token token
+                                :cred cred)
+        (setq initiator context)
+        (setq continue init-continue)
+        (setq token nil)
+        (when output
+          (destructuring-bind (_continue context _name output &rest _)
+              (gss-accept-sec-context output :context acceptor)
+            (setq acceptor context)
+            (setq token output)))))
+    (cons initiator acceptor)))
+
+(defun gss-bench-handshake ()
+  (let ((elapsed (gss-bench--elapsed
+                  (dotimes (_ gss-bench-handshake-iterations)
+                    (gss-bench--establish)))))
+    (list :iterations gss-bench-handshake-iterations
+          :seconds elapsed
+          :handshakes-per-second (/ gss-bench-handshake-iterations elapsed))))
+
+(defun gss-bench--check-round-trip (sender receiver)
+  (let* ((payload (apply #'unibyte-string (number-sequence 0 255)))
+         (plaintext (car (gss-unwrap receiver (car (gss-wrap sender payload :conf t))))))
+    (unless (equal plaintext payload)
+      (error "Imported context returned %S instead of %S" plaintext payload))))
+
+(defun gss-bench-resume ()
+  "Compare resuming a session from exported contexts with a new handshake.
+Both contexts of a pair are exported and imported again. Messages
+wrapped on the original initiator must unwrap on the imported
+acceptor, and the other way round, before any time is reported."
+  (let* ((iterations gss-bench-handshake-iterations)
+         (handshake (gss-bench--elapsed
+                     (dotimes (_ iterations)
+                       (let ((contexts (gss-bench--establish)))
+                         (gss-delete-context (car contexts))
+                         (gss-delete-context (cdr contexts))))))
+         (resume 0))
+    (dotimes (_ iterations)
+      (let* ((contexts (gss-bench--establish))
+             (initiator nil)
+             (acceptor nil))
+        (incf resume (gss-bench--elapsed
+                      (setq acceptor (gss-import-context (gss-export-context (cdr contexts))))))
+        (gss-bench--check-round-trip (car contexts) acceptor)
+        (incf resume (gss-bench--elapsed
+                      (setq initiator (gss-import-context (gss-export-context (car contexts))))))
+        (gss-bench--check-round-trip acceptor initiator)
+        (gss-bench--check-round-trip initiator acceptor)
+        (gss-delete-context initiator)
+        (gss-delete-context acceptor)))
+    (list :iterations iterations
+          :handshake-us (/ (* handshake 1e6) iterations)
+          :resume-us (/ (* resume 1e6) iterations))))
+
+(defun gss-bench--handshakes-per-second (&optional cred)
+  (/ gss-bench-handshake-iterations
+     (gss-bench--elapsed
+      (dotimes (_ gss-bench-handshake-iterations)
+        (let ((contexts (gss-bench--establish cred)))
+          (gss-delete-context (car contexts))
+          (gss-delete-context (cdr contexts)))))))
+
+(defun gss-bench-credentials ()
+  "Compare handshakes per second with and without a held initiator credential.
+:default resolves the default ccache on every handshake, :held passes
+a credential from `gss-acquire-cred', and :default-cache uses the
+module's cached default credential."
+  (let ((cred (gss-acquire-cred)))
+    (prog1
+        (list :default (gss-bench--handshakes-per-second)
+              :held (gss-bench--handshakes-per-second cred)
+              :default-cache (progn
+                               (gss-set-default-credential-cache t)
+                               (gss-bench--handshakes-per-second)))
+      (gss-set-default-credential-cache nil)
+      (gss-release-credential cred))))
+
+(defvar gss-bench-kdc-delays '(0 50 200))
+(defvar gss-bench-latency-iterations 20)
+
+(defun gss-bench--set-kdc-delay (milliseconds)
+  (with-temp-file (getenv "GSS_BENCH_KDC_DELAY_FILE")
+    (insert (number-to-string milliseconds))))
+
+(defun gss-bench--fresh-creds (count)
+  "Return COUNT elements of the form (FILE . CRED).
+Each credential uses a copy of the ccache holding only the TGT, so
+establishing a context with it has to request a service ticket from
+the KDC."
+  (loop repeat count
+        collect (let ((file (make-temp-file "gss-bench-ccache")))
+                  (copy-file (getenv "GSS_BENCH_TGT_CCACHE") file t)
+                  (cons file (gss-acquire-cred :store (list (cons "ccache" (concat "FILE:" file))))))))
+
+(defun gss-bench--free-creds (creds)
+  (loop for (file . cred) in creds
+        do (gss-release-credential cred)
+        do (delete-file file)))
+
+(defun gss-bench--latency-sync (service creds)
+  (let* ((stall 0)
+         (elapsed (gss-bench--elapsed
+                   (loop for (nil . cred) in creds
+                         do (let ((start (float-time)))
+                              (gss-delete-context (nth 1 (gss-init-sec-context service :cred cred)))
+                              (setq stall (max stall (- (float-time) start))))))))
+    (list :seconds elapsed
+          :max-stall-ms (* stall 1000))))
+
+(defun gss-bench--latency-async (service creds)
+  (let* ((pending (length creds))
+         (errors 0)
+         (stall 0)
+         (last (float-time))
+         (timer (run-at-time 0 0.005 (lambda ()
+                                       (let ((now (float-time)))
+                                         (setq stall (max stall (- now last)))
+                                         (setq last now)))))
+         (elapsed (gss-bench--elapsed
+                   (loop for (nil . cred) in creds
+                         do (gss-init-sec-context-async service
+                                                        (lambda (result)
+                                                          (decf pending)
+                                                          (if (eq (car result) 'gss-error)
+                                                              (incf errors)
+                                                            (gss-delete-context (nth 1 result))))
+                                                        :cred cred))
+                   (while (> pending 0)
+                     (accept-process-output nil 0.005)))))
+    (cancel-timer timer)
+    (list :seconds elapsed
+          :max-stall-ms (* stall 1000)
+          :errors errors)))
+
+(defun gss-bench-latency ()
+  "Compare synchronous and asynchronous context establishment against a slow KDC.
+For each delay added by the KDC proxy in milliseconds, a batch of
+contexts is established with credentials that have no service ticket
+yet. :max-stall-ms is the longest time the main loop was blocked."
+  (let ((service (getenv "GSS_BENCH_SERVICE")))
+    (unwind-protect
+        (vconcat (loop for delay in gss-bench-kdc-delays
+                       collect (progn
+                                 (gss-bench--set-kdc-delay delay)
+                                 (list :delay-ms delay
+                                       :sync (let ((creds (gss-bench--fresh-creds gss-bench-latency-iterations)))
+                                               (unwind-protect
+                                                   (gss-bench--latency-sync service creds)
+                                                 (gss-bench--free-creds creds)))
+                                       :async (let ((creds (gss-bench--fresh-creds gss-bench-latency-iterations)))
+                                                (unwind-protect
+                                                    (gss-bench--latency-async service creds)
+                                                  (gss-bench--free-creds creds)))))))
+      (gss-bench--set-kdc-delay 0))))
+
+(defun gss-bench--throughput (size fn)
+  (let* ((payload (make-string size ?x))
+         (iterations (max 1 (/ gss-bench-bytes-per-size size)))
+         (input (funcall fn payload nil))
+         (elapsed (gss-bench--elapsed
+                   (dotimes (_ iterations)
+                     (funcall fn payload input)))))
+    (list :size size
+          :iterations iterations
+          :seconds elapsed
+          :mib-per-second (/ (* size iterations) elapsed 1048576.0))))
+
+(defun gss-bench-throughput (contexts)
+  (let ((initiator (car contexts))
+        (acceptor (cdr contexts))
+        (operations nil))
+    (push (cons :wrap
+                (lambda (payload _)
+                  (car (gss-wrap initiator payload :conf t))))
+          operations)
+    (push (cons :unwrap
+                (lambda (payload token)
+                  (if token
+                      (gss-unwrap acceptor token)
+                    (car (gss-wrap initiator payload :conf t)))))
+          operations)
+    ;; Integrity-only wrap, to compare with the MIC series below without
+    ;; the cost of encryption
+    (push (cons :wrap-integrity
+                (lambda (payload _)
+                  (car (gss-wrap initiator payload :conf nil))))
+          operations)
+    (push (cons :unwrap-integrity
+                (lambda (payload token)
+                  (if token
+                      (gss-unwrap acceptor token)
+                    (car (gss-wrap initiator payload :conf nil)))))
+          operations)
+    (push (cons :get-mic
+                (lambda (payload _)
+                  (gss-get-mic initiator payload)))
+          operations)
+    (push (cons :verify-mic
+                (lambda (payload mic)
+                  (if mic
+                      (gss-verify-mic acceptor payload mic)
+                    (gss-get-mic initiator payload))))
+          operations)
+    (loop for (name . fn) in (nreverse operations)
+          append (list name (vconcat (loop for size in gss-bench-payload-sizes
+                                           collect (gss-bench--throughput size fn)))))))
+
+(defvar gss-bench-frame-sizes '(4096 16384 65536 262144 1048576))
+(defvar gss-bench-framing-file-size (* 16 1024 1024))
+
+(defun gss-bench--framing (contexts file max-frame-size)
+  (let* ((received 0)
+         (unwrap-filter (gss-make-unwrap-filter (cdr contexts)
+                                                (lambda (plaintext) (incf received (length plaintext)))
+                                                :max-frame-size max-frame-size))
+         (wrap-seconds (gss-bench--elapsed
+                        (gss-wrap-file (car contexts) file #'ignore :conf t :max-frame-size max-frame-size)))
+         (round-trip-seconds (gss-bench--elapsed
+                              (gss-wrap-file (car contexts) file
+                                             (lambda (frame) (funcall unwrap-filter nil frame))
+                                             :conf t :max-frame-size max-frame-size))))
+    (unless (= received gss-bench-framing-file-size)
+      (error "Received %d bytes instead of %d" received gss-bench-framing-file-size))
+    (list :max-frame-size max-frame-size
+          :wrap-mib-per-second (/ gss-bench-framing-file-size wrap-seconds 1048576.0)
+          :round-trip-mib-per-second (/ gss-bench-framing-file-size round-trip-seconds 1048576.0))))
+
+(defun gss-bench-framing (contexts)
+  "Measure the streaming framer across frame sizes.
+A file is wrapped with `gss-wrap-file', and then wrapped again and fed
+through a filter from `gss-make-unwrap-filter'."
+  (let ((file (make-temp-file "gss-bench-framing")))
+    (unwind-protect
+        (progn
+          (with-temp-file file
+            (set-buffer-multibyte nil)
+            (insert (make-string gss-bench-framing-file-size ?x)))
+          (vconcat (loop for max-frame-size in gss-bench-frame-sizes
+                         collect (gss-bench--framing contexts file max-frame-size))))
+      (delete-file file))))
+
+(defun gss-bench--per-call (fn)
+  (let ((elapsed (gss-bench--elapsed
+                  (dotimes (_ gss-bench-call-iterations)
+                    (funcall fn)))))
+    (/ (* elapsed 1e6) gss-bench-call-iterations)))
+
+(defun gss-bench--per-message-in-batch (fn size)
+  "Return the cost per message of calling FN on batches of SIZE messages.
+Every batch size processes about the same number of messages."
+  (let* ((batches (max 1 (/ (* 100 gss-bench-call-iterations) size)))
+         (elapsed (gss-bench--elapsed
+                   (dotimes (_ batches)
+                     (funcall fn)))))
+    (/ (* elapsed 1e6) (* batches size))))
+
+(defun gss-bench-overhead (contexts)
+  "Measure the per-call cost of small messages, in microseconds.
+The batch entries give the cost per message of the vector functions,
+to compare with the single-call :internal-wrap and :internal-unwrap."
+  (let* ((initiator (car contexts))
+         (ptr (gss-context/ptr initiator))
+         ;; The acceptor context has sequence checking off, so the same
+         ;; token can be unwrapped repeatedly
+         (acceptor-ptr (gss-context/ptr (cdr contexts)))
+         (payload "x")
+         (token (car (gss-wrap initiator payload))))
+    (list :wrap (gss-bench--per-call (lambda () (gss-wrap initiator payload)))
+          :internal-wrap (gss-bench--per-call (lambda () (gss--internal-wrap ptr payload nil)))
+          :internal-wrap-vector (gss-bench--per-call (lambda () (gss--internal-wrap ptr [120] nil)))
+          :internal-unwrap (gss-bench--per-call (lambda () (gss--internal-unwrap acceptor-ptr token)))
+          :batches (vconcat
+                    (loop for size in gss-bench-batch-sizes
+                          collect (let ((payloads (make-vector size payload))
+                                        (tokens (make-vector size token)))
+                                    (list :size size
+                                          :wrap-many (gss-bench--per-message-in-batch
+                                                      (lambda () (gss--internal-wrap-many ptr payloads nil))
+                                                      size)
+                                          :unwrap-many (gss-bench--per-message-in-batch
+                                                        (lambda () (gss--internal-unwrap-many acceptor-ptr tokens))
+                                                        size))))))))
+
+(defun gss-bench-symbols (contexts)
+  "Measure the per-call cost of small-message wrap and unwrap, in microseconds.
+:intern is the cost of the symbol lookups that every call made before
+symbols were interned once at module load, and :wrap-before and
+:unwrap-before add it back to the current cost."
+  (let* ((initiator (car contexts))
+         (acceptor (cdr contexts))
+         (payload "x")
+         (token (car (gss-wrap initiator payload)))
+         (intern (/ (gss-bench--per-call (lambda () (gss--internal-bench-intern 100))) 100))
+         (wrap (gss-bench--per-call (lambda () (gss-wrap initiator payload))))
+         ;; The acceptor context has sequence checking off, so the same
+         ;; token can be unwrapped repeatedly
+         (unwrap (gss-bench--per-call (lambda () (gss-unwrap acceptor token)))))
+    (list :intern intern
+          :wrap wrap
+          :wrap-before (+ wrap intern)
+          :unwrap unwrap
+          :unwrap-before (+ unwrap intern))))
+
+(defun gss-bench-negotiate ()
+  "Measure the cost of producing an HTTP Negotiate header, in microseconds.
+Compares the native header encoding with the token, base64 and concat
+path in Lisp. Each call establishes a new context, as a client does for
+every request."
+  (let ((service (getenv "GSS_BENCH_SERVICE")))
+    (list :lisp (gss-bench--per-call
+                 (lambda ()
+                   (destructuring-bind (_continue context token _flags) (gss-init-sec-context service :flags-as-integer t)
+                     (prog1 (concat "Negotiate " (base64-encode-string token t))
+                       (gss-delete-context context)))))
+          :native (gss-bench--per-call
+                   (lambda ()
+                     (destructuring-bind (_continue context header _flags) (gss-negotiate-header service :flags-as-integer t)
+                       (prog1 header
+                         (gss-delete-context context))))))))
+
+(defun gss-bench--initiator-tokens (count)
+  (let ((service (getenv "GSS_BENCH_SERVICE")))
+    (loop repeat count
+          collect (destructuring-bind (_continue context token _flags) (gss-init-sec-context service :flags-as-integer t)
+                    (gss-delete-context context)
+                    token))))
+
+(defun gss-bench--accepts-per-second (tokens cred)
+  (let ((elapsed (gss-bench--elapsed
+                  (dolist (token tokens)
+                    (gss-delete-context (nth 1 (gss-accept-sec-context token :cred cred)))))))
+    (/ (length tokens) elapsed)))
+
+(defun gss-bench-acceptor-cred ()
+  "Compare accepts per second with a cached acceptor credential and
+with the keytab resolved again on every accept."
+  (let ((cred (gss-acceptor-credential (getenv "GSS_BENCH_KEYTAB"))))
+    (list :default-keytab (gss-bench--accepts-per-second
+                           (gss-bench--initiator-tokens gss-bench-handshake-iterations) nil)
+          :cached-cred (gss-bench--accepts-per-second
+                        (gss-bench--initiator-tokens gss-bench-handshake-iterations) cred))))
+
+(defun gss-bench--batch-accepts-per-second (tokens cred threads)
+  (let* ((results nil)
+         (elapsed (gss-bench--elapsed
+                   (setq results (let ((gss-accept-threads threads))
+                                   (gss-accept-sec-context-many (mapcar #'list tokens) :cred cred))))))
+    (dolist (result results)
+      (if (eq (car result) 'gss-error)
+          (error "Batch accept failed: %S" result)
+        (gss-delete-context (nth 1 result))))
+    (/ (length tokens) elapsed)))
+
+(defun gss-bench-accept-scaling ()
+  "Measure batch accepts per second for each worker thread count.
+A thread count of 0 runs the whole batch on the main thread."
+  (let ((cred (gss-acceptor-credential (getenv "GSS_BENCH_KEYTAB"))))
+    (vconcat (loop for threads from 0 to (num-processors)
+                   collect (list :threads threads
+                                 :accepts-per-second (gss-bench--batch-accepts-per-second
+                                                      (gss-bench--initiator-tokens gss-bench-handshake-iterations)
+                                                      cred threads))))))
+
+(defun gss-bench-replay ()
+  "Record a trace of handshakes and messages, and replay it through the acceptor.
+The messages are wrapped on the initiator, so the initiator tokens are
+replayed to match them with the replayed contexts."
+  (let ((file (make-temp-file "gss-bench-trace")))
+    (unwind-protect
+        (progn
+          (gss-trace-start file)
+          (dotimes (_ gss-bench-handshake-iterations)
+            (let ((contexts (gss-bench--establish)))
+              (gss-wrap (car contexts) (make-string 1024 ?x) :conf t)
+              (gss-delete-context (car contexts))
+              (gss-delete-context (cdr contexts))))
+          (list :trace (gss-trace-stop)
+                :replay (gss-trace-replay file :keytab (getenv "GSS_BENCH_KEYTAB") :source :initiator)))
+      (gss-trace-stop)
+      (delete-file file))))
+
+(defvar gss-bench-bulk-sizes '(1048576 16777216 134217728))
+
+(defun gss-bench-bulk (contexts)
+  "Compare a bulk channel with chunked `gss-wrap' with confidentiality.
+Each iteration sends the payload from the initiator and receives it
+on the acceptor, using chunks of `gss-bulk-chunk-size' bytes."
+  (let* ((initiator (car contexts))
+         (acceptor (cdr contexts))
+         (transport (gss--internal-transport-new gss-transport-max-receive-size t))
+         (sender (gss-bulk-channel initiator "bench"))
+         (receiver (gss-bulk-channel acceptor "bench"))
+         (operations nil))
+    (push (cons :wrap
+                (lambda (payload _)
+                  (gss--internal-transport-unwrap transport
+                                                  (gss-context/ptr acceptor)
+                                                  (gss--internal-transport-wrap (gss-context/ptr initiator)
+                                                                                payload t gss-bulk-chunk-size))))
+          operations)
+    (push (cons :bulk
+                (lambda (payload _)
+                  (gss-bulk-decrypt receiver (gss-bulk-encrypt sender payload))))
+          operations)
+    (loop for (name . fn) in (nreverse operations)
+          append (list name (vconcat (loop for size in gss-bench-bulk-sizes
+                                           collect (let ((gss-bench-bytes-per-size (max size gss-bench-bytes-per-size)))
+                                                     (gss-bench--throughput size fn))))))))
+
+(defun gss-bench-check ()
+  "Check that exported contexts round-trip, without running the benchmarks."
+  (gss-krb5-register-acceptor-identity (getenv "GSS_BENCH_KEYTAB"))
+  (let ((gss-bench-handshake-iterations 1))
+    (gss-bench-resume))
+  (princ "export/import round trip: ok\n"))
+
+(defun gss-bench-run ()
+  (gss-krb5-register-acceptor-identity (getenv "GSS_BENCH_KEYTAB"))
+  (let* ((contexts (gss-bench--establish))
+         (result (list :emacs-version emacs-version
+                       :commit (or (getenv "GSS_BENCH_COMMIT") "")
+                       :timestamp (format-time-string "%FT%TZ" nil t)
+                       :handshake (gss-bench-handshake)
+                       :resume (gss-bench-resume)
+                       :credentials (gss-bench-credentials)
+                       :latency (gss-bench-latency)
+                       :throughput (gss-bench-throughput contexts)
+                       :framing (gss-bench-framing contexts)
+                       :overhead-us (gss-bench-overhead contexts)
+                       :symbols-us (gss-bench-symbols contexts)
+                       :negotiate-us (gss-bench-negotiate)
+                       :accepts-per-second (gss-bench-acceptor-cred)
+                       :accept-scaling (gss-bench-accept-scaling)
+                       :replay (gss-bench-replay)
+                       :bulk (gss-bench-bulk contexts)
+                       :pool (gss-pool-stats))))
+    (princ (json-encode result))
+    (terpri)))
@@ -0,0 +1,50 @@
+;;; -*- lexical-binding: t -*-
+
+;; A UDP proxy which forwards Kerberos requests to the KDC after a
+;; delay, so that benchmarks can measure context establishment against
+;; a slow KDC. run.sh starts it in a separate batch Emacs and points
+;; krb5.conf at it. The delay in milliseconds is read from the file
+;; named by GSS_BENCH_KDC_DELAY_FILE for every request, and is zero if
+;; the file doesn't exist.
+
+(defvar gss-delay-proxy-port (string-to-number (getenv "GSS_BENCH_PROXY_PORT")))
+(defvar gss-delay-proxy-kdc-port (string-to-number (getenv "GSS_BENCH_KDC_PORT")))
+(defvar gss-delay-proxy-delay-file (getenv "GSS_BENCH_KDC_DELAY_FILE"))
+
+(defun gss-delay-proxy--delay ()
+  (if (file-exists-p gss-delay-proxy-delay-file)
+      (/ (string-to-number (with-temp-buffer
+                             (insert-file-contents gss-delay-proxy-delay-file)
+                             (buffer-string)))
+         1000.0)
+    0))
+
+(defun gss-delay-proxy--forward (server client-address request)
+  (let ((upstream (make-network-process :name "gss-delay-proxy-kdc"
+                                        :type 'datagram
+                                        :host "127.0.0.1"
+                                        :service gss-delay-proxy-kdc-port
+                                        :coding 'binary
+                                        :noquery t)))
+    (set-process-filter upstream
+                        (lambda (process reply)
+                          (set-process-datagram-address server client-address)
+                          (process-send-string server reply)
+                          (delete-process process)))
+    (process-send-string upstream request)))
+
+(defun gss-delay-proxy--filter (server request)
+  (run-at-time (gss-delay-proxy--delay) nil
+               #'gss-delay-proxy--forward server (process-datagram-address server) request))
+
+(defun gss-delay-proxy-run ()
+  (make-network-process :name "gss-delay-proxy"
+                        :type 'datagram
+                        :server t
+                        :host "127.0.0.1"
+                        :service gss-delay-proxy-port
+                        :coding 'binary
+                        :noquery t
+                        :filter #'gss-delay-proxy--filter)
+  (while t
+    (accept-process-output nil 1)))
@@ -0,0 +1,102 @@
+#!/bin/sh
+#
+# Provisions a throwaway MIT Kerberos realm on localhost and runs the
+# benchmarks in bench.el against it. The results are written as JSON
+# to standard output, or to the file named by BENCH_OUTPUT. Another
+# entry point in bench.el, such as gss-bench-check, can be given as the
+# first argument.
+#
+
+set -e
+
+EMACS=${EMACS:-emacs}
+REALM=${REALM:-BENCH.TEST}
+KDC_PORT=${KDC_PORT:-18088}
+PROXY_PORT=${PROXY_PORT:-18089}
+TOP=$(cd "$(dirname "$0")/.." && pwd)
+ENTRY=${1:-gss-bench-run}
+
+WORKDIR=$(mktemp -d)
+KDC_PID=
+PROXY_PID=
+
+cleanup() {
+    if [ -n "$KDC_PID" ]; then
+        kill "$KDC_PID" 2>/dev/null || true
+    fi
+    if [ -n "$PROXY_PID" ]; then
+        kill "$PROXY_PID" 2>/dev/null || true
+    fi
+    rm -rf "$WORKDIR"
+}
+trap cleanup EXIT INT TERM
+
+cat > "$WORKDIR/krb5.conf" <<CONF
+[libdefaults]
+    default_realm = $REALM
+    dns_lookup_kdc = false
+    dns_lookup_realm = false
+    dns_canonicalize_hostname = false
+    rdns = false
+
+[realms]
+    $REALM = {
+        kdc = 127.0.0.1:$PROXY_PORT
+        admin_server = 127.0.0.1:$KDC_PORT
+    }
+
+[domain_realm]
+    localhost = $REALM
+CONF
+
+cat > "$WORKDIR/kdc.conf" <<CONF
+[kdcdefaults]
+    kdc_listen = 127.0.0.1:$KDC_PORT
+    kdc_tcp_listen = 127.0.0.1:$KDC_PORT
+
+[realms]
+    $REALM = {
+        database_name = $WORKDIR/principal
+        key_stash_file = $WORKDIR/stash
+        acl_file = $WORKDIR/kadm5.acl
+    }
+CONF
+
+export KRB5_CONFIG="$WORKDIR/krb5.conf"
+export KRB5_KDC_PROFILE="$WORKDIR/kdc.conf"
+export KRB5CCNAME="FILE:$WORKDIR/ccache"
+export KRB5_KTNAME="FILE:$WORKDIR/service.keytab"
+export KRB5RCACHETYPE=none
+
+kdb5_util create -s -r "$REALM" -P bench-master-password > /dev/null
+kadmin.local -r "$REALM" -q "addprinc -pw bench-password bench" > /dev/null
+kadmin.local -r "$REALM" -q "addprinc -randkey host/localhost" > /dev/null
+kadmin.local -r "$REALM" -q "ktadd -k $WORKDIR/service.keytab host/localhost" > /dev/null
+
+krb5kdc -n -r "$REALM" &
+KDC_PID=$!
+
+# Clients reach the KDC through a proxy which can delay requests
+export GSS_BENCH_PROXY_PORT=$PROXY_PORT
+export GSS_BENCH_KDC_PORT=$KDC_PORT
+export GSS_BENCH_KDC_DELAY_FILE="$WORKDIR/kdc-delay"
+"$EMACS" -Q --batch -l "$TOP/bench/delay-proxy.el" -f gss-delay-proxy-run &
+PROXY_PID=$!
+sleep 1
+
+echo bench-password | kinit bench@"$REALM" > /dev/null
+
+# A ccache holding only the TGT, copied by benchmarks which need the
+# service ticket to be requested from the KDC
+cp "$WORKDIR/ccache" "$WORKDIR/tgt.ccache"
+export GSS_BENCH_TGT_CCACHE="$WORKDIR/tgt.ccache"
+
+export GSS_BENCH_SERVICE=host@localhost
+export GSS_BENCH_COMMIT=$(git -C "$TOP" rev-parse HEAD 2>/dev/null || true)
+export GSS_BENCH_KEYTAB="$WORKDIR/service.keytab"
+
+if [ -n "$BENCH_OUTPUT" ]; then
+    "$EMACS" -Q --batch -L "$TOP" -l "$TOP/bench/bench.el" -f "$ENTRY" > "$BENCH_OUTPUT"
+else
+    "$EMACS" -Q --batch -L "$TOP" -l "$TOP/bench/bench.el" -f "$ENTRY"
+fi
@@ -5,67 +5,739 @@
 (require 'emacs-gssapi)
 
 (defclass gss-name ()
-  ((ptr  :initarg :ptr
-         :reader gss-name/ptr)))
+  ((ptr    :initarg :ptr
+           :reader gss-name/ptr)
+   (string :initform nil)))
 
 (defclass gss-context ()
-  ((ptr :initarg :ptr
-        :reader gss-context/ptr)))
+  ((ptr    :initarg :ptr
+           :reader gss-context/ptr)
+   (expiry :initarg :expiry
+           :initform nil
+           :reader gss-context-expiry
+           :documentation "Time at which the context expires, as returned by `float-time', or nil.")))
+
+(defun gss--make-initiator-context (ptr time-rec)
+  (make-instance 'gss-context
+                 :ptr ptr
+                 :expiry (and time-rec (+ (float-time) time-rec))))
+
+(defclass gss-credential ()
+  ((ptr      :initarg :ptr
+             :reader gss-credential/ptr)
+   (time-rec :initarg :time-rec
+             :reader gss-credential/time-rec)))
+
+;;;
+;;;  Errors. The data of a `gss-error' is a list of the form
+;;;  (MAJOR MINOR ROUTINE CALLING SUPPLEMENTARY MECH), where MECH is
+;;;  the DER encoding of the mechanism OID, or nil if it is not known.
+;;;
+
+(define-error 'gss-error "GSS error")
+
+(defun gss-error-major (err) (nth 1 err))
+(defun gss-error-minor (err) (nth 2 err))
+(defun gss-error-routine (err) (nth 3 err))
+(defun gss-error-calling (err) (nth 4 err))
+(defun gss-error-supplementary (err) (nth 5 err))
+(defun gss-error-mech (err) (nth 6 err))
 
+(defvar gss--status-message-cache (make-hash-table :test 'equal))
+
+(defun gss--status-messages (code mech-code-p mech)
+  (let ((key (list code mech-code-p mech)))
+    (or (gethash key gss--status-message-cache)
+        (puthash key (gss--internal-display-status code mech-code-p mech) gss--status-message-cache))))
+
+(defun gss-error-messages (err)
+  "Return the messages for the error ERR as a list (MAJOR-MESSAGES MINOR-MESSAGES)."
+  (list (gss--status-messages (gss-error-major err) nil nil)
+        (if (zerop (gss-error-minor err))
+            nil
+          (gss--status-messages (gss-error-minor err) t (gss-error-mech err)))))
+
+(defun gss-error-string (err)
+  "Return a human-readable description of the error ERR."
+  (mapconcat #'identity (apply #'append (gss-error-messages err)) ": "))
+
+;; The module returns unibyte strings, except on Emacs versions older
+;; than 28 where tokens are returned as vectors of integers.
+;; Tokens and payloads passed to the module must be unibyte strings, or
+;; multibyte strings containing only ASCII and raw bytes. Encode text
+;; with `encode-coding-string' before wrapping it.
 (defun gss--make-string-from-result (content)
-  (if content
-      (with-temp-buffer
-        (loop for ch across content
-              do (insert ch))
-        (buffer-string))
-    nil))
+  (etypecase content
+    (null nil)
+    (string content)
+    (vector (apply #'unibyte-string (append content nil)))))
+
+;; Values of the GSS_C_*_FLAG constants from RFC 2744
+(defconst gss-flag-deleg #x1)
+(defconst gss-flag-mutual #x2)
+(defconst gss-flag-replay #x4)
+(defconst gss-flag-sequence #x8)
+(defconst gss-flag-conf #x10)
+(defconst gss-flag-integ #x20)
+(defconst gss-flag-anon #x40)
+(defconst gss-flag-prot-ready #x80)
+(defconst gss-flag-trans #x100)
+
+(defconst gss--flag-keywords
+  `((:deleg . ,gss-flag-deleg)
+    (:mutual . ,gss-flag-mutual)
+    (:replay . ,gss-flag-replay)
+    (:sequence . ,gss-flag-sequence)
+    (:conf . ,gss-flag-conf)
+    (:integ . ,gss-flag-integ)
+    (:anon . ,gss-flag-anon)
+    (:prot-ready . ,gss-flag-prot-ready)
+    (:trans . ,gss-flag-trans)))
+
+(defun gss-flags-to-integer (flags)
+  "Convert FLAGS, a list of flag keywords or a bitmask, to a bitmask."
+  (etypecase flags
+    (integer flags)
+    (list (apply #'logior (loop for flag in flags
+                                for value = (cdr (assq flag gss--flag-keywords))
+                                unless value
+                                  do (error "Unknown flag: %S" flag)
+                                collect value)))))
+
+(defun gss-flags-to-list (flags)
+  "Convert the bitmask FLAGS to a list of flag keywords."
+  (check-type flags integer)
+  (loop for (keyword . value) in gss--flag-keywords
+        unless (zerop (logand flags value))
+          collect keyword))
+
+(defun gss--result-flags (flags as-integer)
+  "Return the bitmask FLAGS, or a list of keywords unless AS-INTEGER."
+  (if as-integer flags (gss-flags-to-list flags)))
 
 (cl-defun gss-make-name (name &key (type :hostbased-service))
   (check-type name string)
   (check-type type (member :user-name :machine-uid-name :string-uid-name :hostbased-service))
   (make-instance 'gss-name :ptr (gss--internal-import-name name type)))
 
-(defun gss--token-to-vector (string)
-  (let ((vector (make-vector (length string) 0)))
-    (loop for ch across string
-          for i from 0
-          do (setf (aref vector i) ch))
-    vector))
-
 (defun gss-name-to-string (name)
   (check-type name gss-name)
-  (gss--internal-name-to-string (gss-name/ptr name)))
+  (or (oref name string)
+      (oset name string (gss--internal-name-to-string (gss-name/ptr name)))))
+
+;;;
+;;;  Cache of imported names, keyed by (STRING TYPE CANONICALIZE)
+;;;
+
+(defvar gss-name-cache-capacity 128
+  "Maximum number of names kept in the name cache.
+If zero, names are not cached.")
+
+(defvar gss-name-cache-canonicalize nil
+  "If non-nil, cached names are canonicalised for the Kerberos mechanism.")
+
+;; The hash table maps each key to a node of a circular doubly linked
+;; list, which keeps the names in order of use so that a hit and an
+;; eviction take constant time
+(defstruct (gss--name-cache-node (:constructor gss--make-name-cache-node (key name)))
+  key
+  name
+  prev
+  next)
+
+(defvar gss--name-cache (make-hash-table :test 'equal))
+(defvar gss--name-cache-order nil
+  "Sentinel node of the cached names, most recently used first.")
+(defvar gss--name-cache-hits 0)
+(defvar gss--name-cache-misses 0)
+
+(defun gss--name-cache-reset-order ()
+  (let ((head (gss--make-name-cache-node nil nil)))
+    (setf (gss--name-cache-node-prev head) head
+          (gss--name-cache-node-next head) head)
+    (setq gss--name-cache-order head)))
+
+(gss--name-cache-reset-order)
 
-(cl-defun gss-init-sec-context (name &key flags (time-req 0) context input-token)
+(defun gss--name-cache-unlink (node)
+  (let ((prev (gss--name-cache-node-prev node))
+        (next (gss--name-cache-node-next node)))
+    (setf (gss--name-cache-node-next prev) next
+          (gss--name-cache-node-prev next) prev)))
+
+(defun gss--name-cache-push (node)
+  (let* ((head gss--name-cache-order)
+         (first (gss--name-cache-node-next head)))
+    (setf (gss--name-cache-node-prev node) head
+          (gss--name-cache-node-next node) first
+          (gss--name-cache-node-prev first) node
+          (gss--name-cache-node-next head) node)))
+
+(defun gss--name-cache-evict ()
+  (let ((oldest (gss--name-cache-node-prev gss--name-cache-order)))
+    (gss--name-cache-unlink oldest)
+    (remhash (gss--name-cache-node-key oldest) gss--name-cache)))
+
+(cl-defun gss-cached-name (name &key (type :hostbased-service))
+  "Like `gss-make-name', but reuse a previously imported name if possible."
+  (check-type name string)
+  (if (<= gss-name-cache-capacity 0)
+      (gss-make-name name :type type)
+    ;; Names imported under the other canonicalisation mode must not be
+    ;; returned after `gss-name-cache-canonicalize' is changed
+    (let* ((key (list name type (and gss-name-cache-canonicalize t)))
+           (node (gethash key gss--name-cache)))
+      (cond (node
+             (incf gss--name-cache-hits)
+             (gss--name-cache-unlink node)
+             (gss--name-cache-push node)
+             (gss--name-cache-node-name node))
+            (t
+             (incf gss--name-cache-misses)
+             (let ((result (gss-make-name name :type type)))
+               (when gss-name-cache-canonicalize
+                 (setq result (make-instance 'gss-name
+                                             :ptr (gss--internal-canonicalize-name (gss-name/ptr result)))))
+               (while (>= (hash-table-count gss--name-cache) gss-name-cache-capacity)
+                 (gss--name-cache-evict))
+               (let ((node (gss--make-name-cache-node key result)))
+                 (gss--name-cache-push node)
+                 (puthash key node gss--name-cache))
+               result))))))
+
+(defun gss-name-cache-stats ()
+  "Return a plist describing the state of the name cache."
+  (list :hits gss--name-cache-hits
+        :misses gss--name-cache-misses
+        :size (hash-table-count gss--name-cache)
+        :capacity gss-name-cache-capacity))
+
+(defun gss-name-cache-clear ()
+  "Remove all names from the name cache and reset its counters."
+  (clrhash gss--name-cache)
+  (gss--name-cache-reset-order)
+  (setq gss--name-cache-hits 0)
+  (setq gss--name-cache-misses 0))
+
+(cl-defun gss-acquire-cred (&key name (time-req 0) (usage :initiate) store)
+  "Acquire a credential which can be reused across context establishments.
+NAME is the desired principal, or nil for the default. STORE is an
+alist of credential store options passed to gss_acquire_cred_from,
+for example ((\"ccache\" . \"FILE:/tmp/krb5cc_1000\"))."
+  (check-type name (or null string gss-name))
+  (check-type time-req integer)
+  (check-type usage (member :initiate :accept :both))
+  (check-type store list)
+  (let ((name-native (etypecase name
+                       (null nil)
+                       (string (gss-make-name name :type :user-name))
+                       (gss-name name))))
+    (destructuring-bind (ptr time-rec)
+        (gss--internal-acquire-cred (if name-native (gss-name/ptr name-native) nil)
+                                    time-req
+                                    usage
+                                    (if store
+                                        (apply #'vector (loop for (key . value) in store
+                                                              append (list key value)))
+                                      nil))
+      (make-instance 'gss-credential :ptr ptr :time-rec time-rec))))
+
+(defvar gss--acceptor-credentials (make-hash-table :test 'equal))
+
+(cl-defun gss-acceptor-credential (keytab &key principal)
+  "Return an acceptor credential for the keys in KEYTAB.
+PRINCIPAL restricts the credential to one service principal, for
+example \"HTTP/www.example.com@EXAMPLE.COM\"; if nil, any key in the
+keytab can be used. Credentials are acquired with gss_acquire_cred_from
+and cached per keytab and principal, so the keytab is not resolved
+again on every accept. Several services can use different keytabs in
+the same Emacs."
+  (check-type keytab string)
+  (check-type principal (or null string))
+  (let* ((file (expand-file-name keytab))
+         (key (cons file principal)))
+    (or (gethash key gss--acceptor-credentials)
+        (progn
+          (unless (file-exists-p file)
+            (error "Could not find keytab file: %s" file))
+          (puthash key
+                   (gss-acquire-cred :name principal
+                                     :usage :accept
+                                     :store (list (cons "keytab" file)))
+                   gss--acceptor-credentials)))))
+
+(defun gss-acceptor-credential-clear ()
+  "Forget the cached acceptor credentials, for example after a keytab is rotated."
+  (clrhash gss--acceptor-credentials))
+
+(defun gss-set-default-credential-cache (enable)
+  "Enable or disable caching of the default initiator credential.
+When enabled, `gss-init-sec-context' calls without an explicit
+credential reuse one credential handle, which is acquired again
+shortly before it expires."
+  (gss--internal-set-default-cred-cache enable))
+
+(cl-defun gss-init-sec-context (name &key flags (time-req 0) context input-token cred flags-as-integer)
+  "Initiate a security context with the target NAME.
+Returns a list of the form (CONTINUE-NEEDED CONTEXT TOKEN FLAGS).
+FLAGS is a list of flag keywords, or a bitmask if FLAGS-AS-INTEGER is
+non-nil. The bitmask saves building the list on every call, and can
+be converted later with `gss-flags-to-list'."
   (check-type name (or string gss-name))
-  (check-type flags list)
+  (check-type flags (or integer list))
   (check-type time-req integer)
   (check-type context (or null gss-context))
   (check-type input-token (or null string))
+  (check-type cred (or null gss-credential))
   (let ((name-native (etypecase name
-                       (string (gss-make-name name))
+                       (string (gss-cached-name name))
                        (gss-name name))))
-    (destructuring-bind (continue-needed context content flags)
+    (destructuring-bind (continue-needed context content flags time-rec)
         (gss--internal-init-sec-context (gss-name/ptr name-native)
-                                        flags
+                                        (gss-flags-to-integer flags)
                                         (if context (gss-context/ptr context) nil)
                                         time-req
-                                        (gss--token-to-vector input-token))
+                                        input-token
+                                        (if cred (gss-credential/ptr cred) nil))
       (list continue-needed
-            (make-instance 'gss-context :ptr context)
+            (gss--make-initiator-context context time-rec)
             (gss--make-string-from-result content)
-            flags))))
+            (gss--result-flags flags flags-as-integer)))))
+
+;;;
+;;;  Asynchronous context establishment
+;;;
+
+(defvar gss-async-threads 4
+  "Number of worker threads used for asynchronous operations.")
 
-(cl-defun gss-accept-sec-context (content &key context)
+(defvar gss--async-process nil)
+(defvar gss--async-callbacks (make-hash-table))
+
+(defun gss--async-filter (_process _output)
+  (loop for (id . result) in (gss--internal-async-collect)
+        for (callback . flags-as-integer) = (gethash id gss--async-callbacks)
+        do (remhash id gss--async-callbacks)
+        when (and callback result)
+          ;; An error in one callback must not lose the results which
+          ;; were collected together with it
+          do (with-demoted-errors "Error in GSSAPI callback: %S"
+               (funcall callback
+                        (if (eq (car result) 'gss-error)
+                            result
+                          (destructuring-bind (continue-needed context content flags time-rec) result
+                            (list continue-needed
+                                  (gss--make-initiator-context context time-rec)
+                                  (gss--make-string-from-result content)
+                                  (gss--result-flags flags flags-as-integer))))))))
+
+(defun gss--async-ensure-started ()
+  (unless (process-live-p gss--async-process)
+    (setq gss--async-process (make-pipe-process :name " *gss-async*"
+                                                :noquery t
+                                                :coding 'binary
+                                                :filter #'gss--async-filter))
+    (gss--internal-async-init gss--async-process gss-async-threads)))
+
+(cl-defun gss-init-sec-context-async (name callback &key flags (time-req 0) context input-token cred flags-as-integer)
+  "Like `gss-init-sec-context', but run the call on a worker thread.
+CALLBACK is called with the result when the call completes. If the
+call fails, the result is a list whose car is `gss-error'. Returns an
+identifier which can be passed to `gss-cancel-async'."
+  (check-type name (or string gss-name))
+  (check-type callback function)
+  (check-type flags (or integer list))
+  (check-type time-req integer)
+  (check-type context (or null gss-context))
+  (check-type input-token (or null string))
+  (check-type cred (or null gss-credential))
+  (gss--async-ensure-started)
+  (let* ((name-native (etypecase name
+                        (string (gss-cached-name name))
+                        (gss-name name)))
+         (id (gss--internal-init-sec-context-async (gss-name/ptr name-native)
+                                                   (gss-flags-to-integer flags)
+                                                   (if context (gss-context/ptr context) nil)
+                                                   time-req
+                                                   input-token
+                                                   (if cred (gss-credential/ptr cred) nil))))
+    (puthash id (cons callback flags-as-integer) gss--async-callbacks)
+    id))
+
+(defun gss-cancel-async (id)
+  "Cancel the asynchronous operation ID. Its callback will not be called."
+  (when (gss--internal-async-cancel id)
+    (puthash id nil gss--async-callbacks)
+    t))
+
+(cl-defun gss-accept-sec-context (content &key context cred flags-as-integer)
+  "Accept the token CONTENT sent by an initiator.
+CRED is an acceptor credential, for example one returned by
+`gss-acceptor-credential'. If nil, the default keytab is used.
+FLAGS-AS-INTEGER is as for `gss-init-sec-context'."
   (check-type content string)
   (check-type context (or null gss-context))
+  (check-type cred (or null gss-credential))
   (destructuring-bind (continue-needed context name output-token flags time-rec delegated-cred-handle)
-      (gss--internal-accept-sec-context (gss--token-to-vector content) (if context (gss-context/ptr context) nil))
+      (gss--internal-accept-sec-context content
+                                        (if context (gss-context/ptr context) nil)
+                                        (if cred (gss-credential/ptr cred) nil))
     (list continue-needed
           (make-instance 'gss-context :ptr context)
           (make-instance 'gss-name :ptr name)
           (gss--make-string-from-result output-token)
-          flags
+          (gss--result-flags flags flags-as-integer)
+          time-rec
+          delegated-cred-handle)))
+
+(defvar gss-accept-threads 4
+  "Number of worker threads used by `gss-accept-sec-context-many'.")
+
+(cl-defun gss-accept-sec-context-many (requests &key cred flags-as-integer)
+  "Accept a batch of tokens in parallel.
+REQUESTS is a list of elements of the form (TOKEN . CONTEXT), where
+CONTEXT is nil for a new context. A context must not appear more than
+once in the same batch. CRED is the acceptor credential used for every
+token, or nil for the default keytab. Returns a list with one element
+per request, either of the form returned by `gss-accept-sec-context'
+or a list whose car is `gss-error'. FLAGS-AS-INTEGER is as for
+`gss-init-sec-context'."
+  (check-type cred (or null gss-credential))
+  (let ((results (gss--internal-accept-many
+                  (apply #'vector (mapcar #'car requests))
+                  (apply #'vector (loop for (nil . context) in requests
+                                        collect (if context (gss-context/ptr context) nil)))
+                  gss-accept-threads
+                  (if cred (gss-credential/ptr cred) nil))))
+    (loop for result across results
+          collect (if (eq (car result) 'gss-error)
+                      result
+                    (destructuring-bind (continue-needed context name output-token flags time-rec delegated-cred-handle)
+                        result
+                      (list continue-needed
+                            (make-instance 'gss-context :ptr context)
+                            (make-instance 'gss-name :ptr name)
+                            (gss--make-string-from-result output-token)
+                            (gss--result-flags flags flags-as-integer)
+                            time-rec
+                            delegated-cred-handle))))))
+
+;;;
+;;;  SASL GSSAPI mechanism (RFC 4752), client side
+;;;
+
+(defclass gss-sasl ()
+  ((ptr     :initarg :ptr
+            :reader gss-sasl/ptr)
+   (name    :initarg :name
+            :reader gss-sasl/name)
+   (cred    :initarg :cred
+            :reader gss-sasl/cred)
+   (context :initform nil
+            :reader gss-sasl-context)))
+
+(defconst gss--sasl-layers
+  '((:none . 1)
+    (:integrity . 2)
+    (:confidentiality . 4)))
+
+(cl-defun gss-sasl-start (service &key (flags '(:mutual :sequence)) cred
+                                  (layers '(:none :integrity :confidentiality))
+                                  (max-buffer 65536) authzid)
+  "Start a SASL GSSAPI exchange with SERVICE, for example \"imap@host\".
+LAYERS lists the acceptable security layers; the strongest one
+offered by the server is chosen. MAX-BUFFER is the largest message
+the client is willing to receive, and AUTHZID is the authorization
+identity to request, or nil. Call `gss-sasl-step' with each server
+challenge."
+  (check-type service (or string gss-name))
+  (check-type flags (or integer list))
+  (check-type cred (or null gss-credential))
+  (check-type layers list)
+  (check-type max-buffer (integer 0 #xffffff))
+  (check-type authzid (or null string))
+  (make-instance 'gss-sasl
+                 :ptr (gss--internal-sasl-new (gss-flags-to-integer flags)
+                                              (apply #'logior
+                                                     (loop for layer in layers
+                                                           for value = (cdr (assq layer gss--sasl-layers))
+                                                           unless value
+                                                             do (error "Unknown SASL security layer: %S" layer)
+                                                           collect value))
+                                              max-buffer
+                                              ;; Encoded as UTF-8 by the module
+                                              authzid)
+                 :name (etypecase service
+                         (string (gss-cached-name service))
+                         (gss-name service))
+                 :cred cred))
+
+(defun gss-sasl-step (sasl challenge)
+  "Process the server CHALLENGE, nil for the first step, in the exchange SASL.
+Returns a list (DONE RESPONSE), where RESPONSE is the unibyte string to
+send to the server, possibly empty. When DONE is non-nil the exchange
+is complete and the security layer is in effect."
+  (check-type sasl gss-sasl)
+  (check-type challenge (or null string))
+  (destructuring-bind (done context response)
+      (gss--internal-sasl-step (gss-sasl/ptr sasl)
+                               (gss-name/ptr (gss-sasl/name sasl))
+                               (and (gss-sasl-context sasl) (gss-context/ptr (gss-sasl-context sasl)))
+                               challenge
+                               (and (gss-sasl/cred sasl) (gss-credential/ptr (gss-sasl/cred sasl))))
+    (unless (gss-sasl-context sasl)
+      (oset sasl context (make-instance 'gss-context :ptr context)))
+    (list done (gss--make-string-from-result response))))
+
+(defun gss-sasl-security-layer (sasl)
+  "Return the security layer negotiated by SASL as a plist, or nil.
+:layer is one of :none, :integrity and :confidentiality.
+:server-max-buffer and :client-max-buffer are the largest messages
+each side accepts, and :wrap-limit is the largest plaintext which
+`gss-sasl-wrap' can send in one message."
+  (check-type sasl gss-sasl)
+  (destructuring-bind (done layer server-max-buffer client-max-buffer wrap-limit)
+      (gss--internal-sasl-info (gss-sasl/ptr sasl))
+    (when done
+      (list :layer (car (rassq layer gss--sasl-layers))
+            :server-max-buffer server-max-buffer
+            :client-max-buffer client-max-buffer
+            :wrap-limit wrap-limit))))
+
+(defun gss-sasl-wrap (sasl data)
+  "Protect DATA according to the security layer negotiated by SASL.
+DATA must not be longer than the :wrap-limit of the security layer."
+  (check-type sasl gss-sasl)
+  (check-type data string)
+  (destructuring-bind (&key layer wrap-limit &allow-other-keys) (gss-sasl-security-layer sasl)
+    (when (eq layer :none)
+      (error "No SASL security layer is in effect"))
+    (unless layer
+      (error "SASL negotiation is not complete"))
+    (when (> (string-bytes data) wrap-limit)
+      (error "Message of %d bytes exceeds the SASL limit of %d" (string-bytes data) wrap-limit))
+    (car (gss-wrap (gss-sasl-context sasl) data :conf (eq layer :confidentiality)))))
+
+(defun gss-sasl-unwrap (sasl data)
+  "Unprotect DATA received on the security layer negotiated by SASL.
+DATA must not be longer than the :client-max-buffer of the security
+layer, and must be encrypted if the layer provides confidentiality."
+  (check-type sasl gss-sasl)
+  (check-type data string)
+  (destructuring-bind (&key layer client-max-buffer &allow-other-keys) (gss-sasl-security-layer sasl)
+    (when (eq layer :none)
+      (error "No SASL security layer is in effect"))
+    (unless layer
+      (error "SASL negotiation is not complete"))
+    (when (> (string-bytes data) client-max-buffer)
+      (error "Message of %d bytes exceeds the SASL limit of %d" (string-bytes data) client-max-buffer))
+    (destructuring-bind (plaintext conf) (gss-unwrap (gss-sasl-context sasl) data)
+      (when (and (eq layer :confidentiality) (not conf))
+        (error "Message is not encrypted"))
+      plaintext)))
+
+;;;
+;;;  Pool of pre-established initiator contexts, keyed by target and
+;;;  flags. Each pool keeps up to `gss-context-pool-size' fresh
+;;;  contexts and their first tokens, and is refilled in the background
+;;;  with `gss-init-sec-context-async'.
+;;;
+
+(defvar gss-context-pool-size 4
+  "Number of contexts kept ready per target and flags.")
+
+(defvar gss-context-pool-expiry-margin 60
+  "Pooled contexts which expire within this many seconds are discarded.")
+
+(defvar gss-context-pool-max-age 120
+  "Pooled contexts older than this many seconds are discarded.
+The first token of a context carries the time at which it was
+created, and acceptors reject tokens outside their clock skew
+allowance, typically 300 seconds. This should stay well below it.")
+
+(defstruct (gss--context-pool (:constructor gss--make-context-pool (name flags)))
+  name
+  flags
+  ;; Elements of the form (CREATED . RESULT), where RESULT is a result
+  ;; of `gss-init-sec-context' with the flags as a bitmask, oldest first
+  (entries nil)
+  (pending 0))
+
+(defvar gss--context-pools (make-hash-table :test 'equal))
+(defvar gss--context-pool-hits 0)
+(defvar gss--context-pool-misses 0)
+(defvar gss--context-pool-evictions 0)
+(defvar gss--context-pool-refills 0)
+(defvar gss--context-pool-refill-failures 0)
+(defvar gss--context-pool-refill-seconds 0.0)
+(defvar gss--context-pool-refill-max-seconds 0.0)
+
+(defun gss--context-pool-expired-p (entry)
+  (destructuring-bind (created . result) entry
+    (let ((now (float-time))
+          (expiry (gss-context-expiry (nth 1 result))))
+      (or (> (- now created) gss-context-pool-max-age)
+          (and expiry (< expiry (+ now gss-context-pool-expiry-margin)))))))
+
+(defun gss--context-pool-evict (pool)
+  (setf (gss--context-pool-entries pool)
+        (loop for entry in (gss--context-pool-entries pool)
+              if (gss--context-pool-expired-p entry)
+                do (incf gss--context-pool-evictions)
+                   (gss-delete-context (nth 1 (cdr entry)))
+              else
+                collect entry)))
+
+(defun gss--context-pool-refill (key pool)
+  (loop repeat (- gss-context-pool-size
+                  (length (gss--context-pool-entries pool))
+                  (gss--context-pool-pending pool))
+        do (let ((start (float-time)))
+             (incf (gss--context-pool-pending pool))
+             (gss-init-sec-context-async
+              (gss--context-pool-name pool)
+              (lambda (result)
+                (decf (gss--context-pool-pending pool))
+                (cond ((eq (car result) 'gss-error)
+                       (incf gss--context-pool-refill-failures))
+                      ((eq (gethash key gss--context-pools) pool)
+                       (let ((elapsed (- (float-time) start)))
+                         (incf gss--context-pool-refills)
+                         (incf gss--context-pool-refill-seconds elapsed)
+                         (setq gss--context-pool-refill-max-seconds
+                               (max gss--context-pool-refill-max-seconds elapsed)))
+                       (setf (gss--context-pool-entries pool)
+                             (nconc (gss--context-pool-entries pool) (list (cons start result)))))
+                      ;; The pool has been cleared in the meantime
+                      (t
+                       (gss-delete-context (nth 1 result)))))
+              :flags (gss--context-pool-flags pool)
+              :flags-as-integer t))))
+
+(defun gss--context-pool-get (name flags)
+  (let ((key (cons name flags)))
+    (or (gethash key gss--context-pools)
+        (puthash key (gss--make-context-pool name flags) gss--context-pools))))
+
+(cl-defun gss-context-pool-take (name &key flags flags-as-integer)
+  "Return a new initiator context for NAME, taken from the pool if possible.
+The result has the same form as the result of `gss-init-sec-context'
+called without a context or input token, and FLAGS-AS-INTEGER is as
+for that function. The context belongs to the caller, and the pool is
+refilled in the background."
+  (check-type name string)
+  (check-type flags (or integer list))
+  (let* ((flags (gss-flags-to-integer flags))
+         (pool (gss--context-pool-get name flags)))
+    (gss--context-pool-evict pool)
+    (prog1
+        (if (gss--context-pool-entries pool)
+            (progn
+              (incf gss--context-pool-hits)
+              (destructuring-bind (continue-needed context content ret-flags)
+                  (cdr (pop (gss--context-pool-entries pool)))
+                (list continue-needed context content (gss--result-flags ret-flags flags-as-integer))))
+          (incf gss--context-pool-misses)
+          (gss-init-sec-context name :flags flags :flags-as-integer flags-as-integer))
+      (gss--context-pool-refill (cons name flags) pool))))
+
+(cl-defun gss-context-pool-warm (name &key flags)
+  "Start filling the pool for NAME and FLAGS without taking a context."
+  (check-type name string)
+  (check-type flags (or integer list))
+  (let* ((flags (gss-flags-to-integer flags))
+         (pool (gss--context-pool-get name flags)))
+    (gss--context-pool-evict pool)
+    (gss--context-pool-refill (cons name flags) pool)))
+
+(defun gss-context-pool-clear ()
+  "Delete all pooled contexts and reset the pool counters."
+  (maphash (lambda (_key pool)
+             (dolist (entry (gss--context-pool-entries pool))
+               (gss-delete-context (nth 1 (cdr entry)))))
+           gss--context-pools)
+  (clrhash gss--context-pools)
+  (setq gss--context-pool-hits 0)
+  (setq gss--context-pool-misses 0)
+  (setq gss--context-pool-evictions 0)
+  (setq gss--context-pool-refills 0)
+  (setq gss--context-pool-refill-failures 0)
+  (setq gss--context-pool-refill-seconds 0.0)
+  (setq gss--context-pool-refill-max-seconds 0.0))
+
+(defun gss-context-pool-stats ()
+  "Return a plist describing the context pools.
+Refill latencies are in seconds, from the request to the arrival of
+the context."
+  (let ((total (+ gss--context-pool-hits gss--context-pool-misses))
+        (ready 0))
+    (maphash (lambda (_key pool)
+               (incf ready (length (gss--context-pool-entries pool))))
+             gss--context-pools)
+    (list :hits gss--context-pool-hits
+          :misses gss--context-pool-misses
+          :hit-rate (if (zerop total) nil (/ (float gss--context-pool-hits) total))
+          :evictions gss--context-pool-evictions
+          :refills gss--context-pool-refills
+          :refill-failures gss--context-pool-refill-failures
+          :refill-mean-latency (if (zerop gss--context-pool-refills)
+                                   nil
+                                 (/ gss--context-pool-refill-seconds gss--context-pool-refills))
+          :refill-max-latency gss--context-pool-refill-max-seconds
+          :pools (hash-table-count gss--context-pools)
+          :ready ready)))
+
+;;;
+;;;  HTTP Negotiate authentication (RFC 4559)
+;;;
+
+(cl-defun gss-negotiate-header (name &key flags (time-req 0) context header cred flags-as-integer)
+  "Produce the value of an Authorization header for HTTP Negotiate.
+This is like `gss-init-sec-context', but the SPNEGO mechanism is used
+and tokens are exchanged as header values of the form \"Negotiate
+<base64>\". HEADER is the value of the WWW-Authenticate header sent by
+the server, or nil for the first request. Returns a list of the form
+(CONTINUE-NEEDED CONTEXT HEADER FLAGS), where HEADER is nil if there
+is nothing to send. FLAGS-AS-INTEGER is as for `gss-init-sec-context'."
+  (check-type name (or string gss-name))
+  (check-type flags (or integer list))
+  (check-type time-req integer)
+  (check-type context (or null gss-context))
+  (check-type header (or null string))
+  (check-type cred (or null gss-credential))
+  (let ((name-native (etypecase name
+                       (string (gss-cached-name name))
+                       (gss-name name))))
+    (destructuring-bind (continue-needed context header flags time-rec)
+        (gss--internal-negotiate-header (gss-name/ptr name-native)
+                                        (gss-flags-to-integer flags)
+                                        (if context (gss-context/ptr context) nil)
+                                        time-req
+                                        header
+                                        (if cred (gss-credential/ptr cred) nil))
+      (list continue-needed
+            (gss--make-initiator-context context time-rec)
+            header
+            (gss--result-flags flags flags-as-integer)))))
+
+(cl-defun gss-negotiate-accept-header (header &key context cred flags-as-integer)
+  "Accept the value HEADER of an Authorization header for HTTP Negotiate.
+Returns a list of the same form as `gss-accept-sec-context', except
+that the output token is the value of the WWW-Authenticate header to
+send back, or nil if there is nothing to send. CRED and
+FLAGS-AS-INTEGER are as for `gss-accept-sec-context'."
+  (check-type header string)
+  (check-type context (or null gss-context))
+  (check-type cred (or null gss-credential))
+  (destructuring-bind (continue-needed context name output-header flags time-rec delegated-cred-handle)
+      (gss--internal-negotiate-accept-header header
+                                             (if context (gss-context/ptr context) nil)
+                                             (if cred (gss-credential/ptr cred) nil))
+    (list continue-needed
+          (make-instance 'gss-context :ptr context)
+          (make-instance 'gss-name :ptr name)
+          output-header
+          (gss--result-flags flags flags-as-integer)
           time-rec
           delegated-cred-handle)))
 
@@ -79,14 +751,554 @@
   (check-type context gss-context)
   (check-type data string)
   (destructuring-bind (data conf)
-      (gss--internal-wrap (gss-context/ptr context) (gss--token-to-vector data) conf)
+      (gss--internal-wrap (gss-context/ptr context) data conf)
     (list (gss--make-string-from-result data) conf)))
 
-(cl-defun gss-unwrap (context data)
+(cl-defun gss-unwrap (context data &key noerror)
+  "Unwrap DATA and return a list of the form (PLAINTEXT CONF).
+If NOERROR is non-nil, errors are not signalled. The result is then a
+list (STATUS PLAINTEXT CONF SUPPLEMENTARY), where STATUS is :ok or one
+of :bad-sig, :defective-token, :no-context, :context-expired,
+:bad-qop and :failure, PLAINTEXT is nil unless STATUS is :ok, and
+SUPPLEMENTARY is a list of the keywords :duplicate-token, :old-token,
+:unseq-token and :gap-token."
   (check-type context gss-context)
   (check-type data string)
+  (if noerror
+      (destructuring-bind (status data conf supplementary)
+          (gss--internal-unwrap (gss-context/ptr context) data t)
+        (list status (gss--make-string-from-result data) conf supplementary))
+    (destructuring-bind (data conf)
+        (gss--internal-unwrap (gss-context/ptr context) data)
+      (list (gss--make-string-from-result data) conf))))
+
+(cl-defun gss-wrap-region (context start end &key conf)
+  (check-type context gss-context)
+  (destructuring-bind (data conf)
+      (gss--internal-wrap-iov (gss-context/ptr context) (buffer-substring-no-properties start end) conf)
+    (list (gss--make-string-from-result data) conf)))
+
+(cl-defun gss-unwrap-region (context start end)
+  (check-type context gss-context)
   (destructuring-bind (data conf)
-      (gss--internal-unwrap (gss-context/ptr context) (gss--token-to-vector data))
+      (gss--internal-unwrap-iov (gss-context/ptr context) (buffer-substring-no-properties start end))
     (list (gss--make-string-from-result data) conf)))
 
+(cl-defun gss-wrap-size-limit (context max-output-size &key conf)
+  "Return the largest message that wraps into at most MAX-OUTPUT-SIZE bytes."
+  (check-type context gss-context)
+  (check-type max-output-size integer)
+  (gss--internal-wrap-size-limit (gss-context/ptr context) conf max-output-size))
+
+(cl-defun gss-inquire-context (context &key flags-as-integer)
+  "Return a list of the form (TIME-REC FLAGS LOCALLY-INITIATED OPEN).
+FLAGS and FLAGS-AS-INTEGER are as for `gss-init-sec-context'."
+  (check-type context gss-context)
+  (destructuring-bind (time-rec flags locally-initiated open)
+      (gss--internal-inquire-context (gss-context/ptr context))
+    (list time-rec (gss--result-flags flags flags-as-integer) locally-initiated open)))
+
+(defun gss-get-mic (context data)
+  "Return a MIC token over DATA, without including DATA in the token."
+  (check-type context gss-context)
+  (check-type data string)
+  (gss--make-string-from-result (gss--internal-get-mic (gss-context/ptr context) data)))
+
+(cl-defun gss-verify-mic (context data mic &key noerror)
+  "Verify MIC over DATA.
+Return a list of the form (QOP SUPPLEMENTARY), where SUPPLEMENTARY is
+a list of the supplementary status keywords described in `gss-unwrap'.
+An invalid MIC raises `gss-error'.
+
+If NOERROR is non-nil, errors are not signalled and the result is a
+list (STATUS QOP SUPPLEMENTARY), with STATUS and SUPPLEMENTARY as
+described in `gss-unwrap'."
+  (check-type context gss-context)
+  (check-type data string)
+  (check-type mic string)
+  (if noerror
+      (gss--internal-verify-mic (gss-context/ptr context) data mic t)
+    (gss--internal-verify-mic (gss-context/ptr context) data mic)))
+
+(defun gss-get-mic-region (context start end)
+  (gss-get-mic context (buffer-substring-no-properties start end)))
+
+(defun gss-verify-mic-region (context start end mic)
+  (gss-verify-mic context (buffer-substring-no-properties start end) mic))
+
+(defun gss-export-context (context)
+  "Serialise CONTEXT to a unibyte string.
+The context can't be used after it has been exported. The string can
+be passed to `gss-import-context', possibly in another process, to
+resume the session without a new handshake."
+  (check-type context gss-context)
+  (gss--make-string-from-result (gss--internal-export-sec-context (gss-context/ptr context))))
+
+(defun gss-import-context (token)
+  "Rebuild a context from a string returned by `gss-export-context'."
+  (check-type token string)
+  (make-instance 'gss-context :ptr (gss--internal-import-sec-context token)))
+;;;
+;;;  Explicit release of native handles. Handles which are not released
+;;;  explicitly are freed when they are garbage collected.
+;;;
+
+(defun gss-delete-context (context)
+  "Delete CONTEXT and free its native state immediately.
+Passing the context to any other function afterwards signals an
+error saying that it has been released. Deleting a context twice is
+harmless."
+  (check-type context gss-context)
+  (when (gss-context/ptr context)
+    (gss--internal-delete-sec-context (gss-context/ptr context))))
+
+(defun gss-release-name (name)
+  "Free the native state of NAME immediately and remove it from the name cache.
+If an asynchronous operation is still using NAME, it is freed when
+that operation completes."
+  (check-type name gss-name)
+  (loop for key being the hash-keys of gss--name-cache using (hash-values node)
+        when (eq (gss--name-cache-node-name node) name)
+          do (gss--name-cache-unlink node)
+             (remhash key gss--name-cache))
+  (when (gss-name/ptr name)
+    (gss--internal-release-name (gss-name/ptr name))))
+
+(defun gss-release-credential (cred)
+  "Free the native state of CRED immediately.
+If an asynchronous operation is still using CRED, it is freed when
+that operation completes. CRED is also removed from the cache of
+`gss-acceptor-credential'."
+  (check-type cred gss-credential)
+  (loop for key being the hash-keys of gss--acceptor-credentials using (hash-values entry)
+        when (eq entry cred)
+          do (remhash key gss--acceptor-credentials))
+  (gss--internal-release-cred (gss-credential/ptr cred)))
+
+(defmacro with-gss-context (spec &rest body)
+  "Bind VAR to the value of FORM, evaluate BODY and delete the context.
+SPEC has the form (VAR FORM). FORM must return a `gss-context' or nil.
+The context is deleted with `gss-delete-context' when BODY exits,
+normally or not.
+
+\(fn (VAR FORM) BODY...)"
+  (declare (indent 1) (debug ((symbolp form) body)))
+  (destructuring-bind (var form) spec
+    `(let ((,var ,form))
+       (unwind-protect
+           (progn ,@body)
+         (when ,var
+           (gss-delete-context ,var))))))
+
+(defun gss-live-handles ()
+  "Return a plist with the number of native handles currently alive.
+:bytes is the memory allocated by the module for these handles; the
+memory held inside the GSSAPI library is not included."
+  (destructuring-bind (names contexts creds bytes) (gss--internal-live-handles)
+    (list :names names
+          :contexts contexts
+          :credentials creds
+          :bytes bytes)))
+
+
+;;;
+;;;  Streaming of wrapped messages. Each message is sent as a 4-byte
+;;;  big-endian length followed by the wrapped token.
+;;;
+
+(defconst gss-default-max-frame-size 65536)
+
+(defun gss--encode-frame-length (length)
+  (unibyte-string (logand (ash length -24) #xff)
+                  (logand (ash length -16) #xff)
+                  (logand (ash length -8) #xff)
+                  (logand length #xff)))
+
+(defun gss--decode-frame-length (string offset)
+  (logior (ash (aref string offset) 24)
+          (ash (aref string (+ offset 1)) 16)
+          (ash (aref string (+ offset 2)) 8)
+          (aref string (+ offset 3))))
+
+(defun gss--wrap-frame (context data conf)
+  (let ((token (car (gss-wrap context data :conf conf))))
+    (concat (gss--encode-frame-length (length token)) token)))
+
+(defun gss--frame-chunk-size (context max-frame-size conf)
+  "Return the largest plaintext which wraps into a frame of MAX-FRAME-SIZE bytes."
+  (let ((chunk-size (gss-wrap-size-limit context (max 0 (- max-frame-size 4)) :conf conf)))
+    (when (<= chunk-size 0)
+      (error "Frames of %d bytes are too small to hold any data" max-frame-size))
+    chunk-size))
+
+(cl-defun gss-wrap-file (context file sink &key conf (max-frame-size gss-default-max-frame-size))
+  "Wrap the content of FILE as a sequence of length-prefixed frames.
+SINK is called with each frame in turn. The file is read one chunk at
+a time, and no frame is larger than MAX-FRAME-SIZE bytes."
+  (check-type context gss-context)
+  (check-type file string)
+  (check-type max-frame-size integer)
+  (let ((chunk-size (gss--frame-chunk-size context max-frame-size conf))
+        (size (nth 7 (file-attributes file))))
+    (with-temp-buffer
+      (set-buffer-multibyte nil)
+      (loop for offset from 0 below size by chunk-size
+            do (erase-buffer)
+               (insert-file-contents-literally file nil offset (min size (+ offset chunk-size)))
+               (funcall sink (gss--wrap-frame context (buffer-string) conf))))))
+
+(cl-defun gss-make-wrap-filter (context sink &key conf (max-frame-size gss-default-max-frame-size))
+  "Return a process filter which wraps the output of a process.
+The output is split into length-prefixed frames of at most
+MAX-FRAME-SIZE bytes, and SINK is called with each frame. Output which
+the process has decoded is encoded back to bytes with its coding
+system."
+  (check-type context gss-context)
+  (check-type max-frame-size integer)
+  (let ((chunk-size (gss--frame-chunk-size context max-frame-size conf)))
+    (lambda (process output)
+      (let ((output (if (multibyte-string-p output)
+                        (encode-coding-string output (car (process-coding-system process)) t)
+                      output)))
+        (loop for offset from 0 below (length output) by chunk-size
+              do (funcall sink (gss--wrap-frame context
+                                                (substring output offset (min (length output) (+ offset chunk-size)))
+                                                conf)))))))
+
+(cl-defun gss-make-unwrap-filter (context sink &key on-error allow-supplementary
+                                                (max-frame-size gss-default-max-frame-size))
+  "Return a process filter which unwraps length-prefixed frames.
+Incomplete frames are buffered until the rest of the data arrives, and
+SINK is called with the plaintext of each frame. The process should
+use the `binary' coding system. A frame larger than MAX-FRAME-SIZE
+bytes signals an error, and the buffered data is discarded.
+
+A frame which unwraps but has supplementary status bits set, such as
+a replayed or out of sequence token, is dropped unless
+ALLOW-SUPPLEMENTARY is non-nil. See `gss-unwrap'.
+
+If ON-ERROR is nil, a frame which fails to unwrap signals `gss-error'.
+Otherwise, ON-ERROR is called with the status, the supplementary
+status and the token of every frame which failed to unwrap or which
+has supplementary status bits set."
+  (check-type context gss-context)
+  (check-type on-error (or null function))
+  (check-type max-frame-size integer)
+  ;; Received strings are kept in a list and only concatenated once
+  ;; they complete a frame, so that a large frame arriving in small
+  ;; pieces is not copied again for every piece
+  (let ((chunks nil)
+        (pending-length 0)
+        (needed 4))
+    (lambda (_process output)
+      (push output chunks)
+      (incf pending-length (length output))
+      (when (>= pending-length needed)
+        (let ((pending (apply #'concat (nreverse chunks)))
+              (offset 0)
+              (length nil))
+          (setq chunks nil)
+          (setq needed 4)
+          ;; The data after the last complete frame is kept even if
+          ;; SINK or the unwrapping signals
+          (unwind-protect
+              (while (and (>= (- (length pending) offset) 4)
+                          (progn
+                            (setq length (gss--decode-frame-length pending offset))
+                            (when (> (+ length 4) max-frame-size)
+                              ;; The stream can't be resynchronised
+                              (setq offset (length pending))
+                              (error "Frame of %d bytes exceeds the maximum of %d" (+ length 4) max-frame-size))
+                            (or (>= (- (length pending) offset 4) length)
+                                (progn (setq needed (+ length 4)) nil))))
+                (let ((token (substring pending (+ offset 4) (+ offset 4 length))))
+                  (setq offset (+ offset 4 length))
+                  (destructuring-bind (status plaintext _conf supplementary)
+                      (gss-unwrap context token :noerror t)
+                    (cond ((and (not (eq status :ok)) (null on-error))
+                           ;; Unwrapping a bad token again fails the same
+                           ;; way, and signals the full error data
+                           (gss-unwrap context token))
+                          ((or (not (eq status :ok)) supplementary)
+                           (funcall on-error status supplementary token)))
+                    (when (and (eq status :ok) (or allow-supplementary (null supplementary)))
+                      (funcall sink plaintext)))))
+            (setq pending-length (- (length pending) offset))
+            (when (> pending-length 0)
+              (push (substring pending offset) chunks))))))))
+
+;; Each element of the returned vector is either a list of the form
+;; (DATA CONF) as returned by `gss-wrap', or a list whose car is
+;; `gss-error' describing why that particular message failed.
+(defun gss--batch-results (results)
+  (loop for result across-ref results
+        unless (eq (car result) 'gss-error)
+          do (setf result (list (gss--make-string-from-result (car result)) (cadr result))))
+  results)
+
+(cl-defun gss-wrap-many (context messages &key conf)
+  (check-type context gss-context)
+  (check-type messages (or list vector))
+  (gss--batch-results (gss--internal-wrap-many (gss-context/ptr context) (vconcat messages) conf)))
+
+(cl-defun gss-unwrap-many (context messages)
+  (check-type context gss-context)
+  (check-type messages (or list vector))
+  (gss--batch-results (gss--internal-unwrap-many (gss-context/ptr context) (vconcat messages))))
+
+;;;
+;;;  Protected transport bound to a network process. Frames use the
+;;;  same format as the streaming functions above, and are wrapped and
+;;;  unwrapped in the module.
+;;;
+
+(defclass gss-transport ()
+  ((ptr        :initarg :ptr
+               :reader gss-transport/ptr)
+   (context    :initarg :context
+               :reader gss-transport-context)
+   (conf       :initarg :conf
+               :reader gss-transport/conf)
+   (chunk-size :initarg :chunk-size
+               :reader gss-transport/chunk-size)
+   (filter     :initarg :filter
+               :reader gss-transport/filter)))
+
+(defvar gss-transport-max-receive-size (* 16 1024 1024)
+  "Largest frame accepted from the peer of a transport, in bytes.")
+
+(cl-defun gss-transport-attach (process context &key conf (max-frame-size gss-default-max-frame-size) on-error)
+  "Protect the traffic of PROCESS with CONTEXT.
+Data sent with `gss-transport-send' is wrapped and split into
+length-prefixed frames of at most MAX-FRAME-SIZE bytes. Frames
+received from the peer are unwrapped, and the filter which PROCESS
+had when this function was called receives the plaintext. The process
+coding system is set to `binary'.
+
+If a frame fails to unwrap, it is dropped and ON-ERROR is called with
+the process and the error data, or `gss-error' is signalled if
+ON-ERROR is nil. Replayed or out of sequence frames are dropped in the
+same way, and so are unencrypted frames when CONF is non-nil."
+  (check-type process process)
+  (check-type context gss-context)
+  (check-type on-error (or null function))
+  (let ((transport (make-instance 'gss-transport
+                                  :ptr (gss--internal-transport-new gss-transport-max-receive-size conf)
+                                  :context context
+                                  :conf conf
+                                  :chunk-size (gss--frame-chunk-size context max-frame-size conf)
+                                  :filter (process-filter process))))
+    (set-process-coding-system process 'binary 'binary)
+    (process-put process 'gss-transport transport)
+    (set-process-filter process
+                        (lambda (process output)
+                          (destructuring-bind (plaintext error)
+                              (gss--internal-transport-unwrap (gss-transport/ptr transport)
+                                                              (gss-context/ptr context)
+                                                              output)
+                            (let ((plaintext (gss--make-string-from-result plaintext)))
+                              (unless (zerop (length plaintext))
+                                (funcall (gss-transport/filter transport) process plaintext)))
+                            (when error
+                              (if on-error
+                                  (funcall on-error process error)
+                                (signal 'gss-error error))))))
+    transport))
+
+(defun gss-transport-detach (process)
+  "Stop protecting the traffic of PROCESS and restore its original filter.
+Data of a partially received frame is discarded."
+  (let ((transport (process-get process 'gss-transport)))
+    (when transport
+      (set-process-filter process (gss-transport/filter transport))
+      (process-put process 'gss-transport nil))))
+
+(defun gss-transport-send (process data)
+  "Wrap DATA and send it to PROCESS, which must have a transport attached."
+  (check-type data string)
+  (let ((transport (or (process-get process 'gss-transport)
+                       (error "No GSS transport attached to %S" process))))
+    (process-send-string process
+                         (gss--make-string-from-result
+                          (gss--internal-transport-wrap (gss-context/ptr (gss-transport-context transport))
+                                                        data
+                                                        (gss-transport/conf transport)
+                                                        (gss-transport/chunk-size transport))))))
+
+;;;
+;;;  Bulk data channel. Keys for each direction are derived from an
+;;;  established context with `gss-pseudo-random', and large streams
+;;;  are encrypted in the module without a `gss-wrap' call per chunk.
+;;;
+
+(cl-defun gss-pseudo-random (context input length &key partial)
+  "Return LENGTH pseudo-random bytes derived from CONTEXT and INPUT.
+Both peers of the context obtain the same bytes for the same INPUT.
+If PARTIAL is non-nil, the key available to every holder of the
+context's session key is used instead of the key that only the
+initiator and acceptor share."
+  (check-type context gss-context)
+  (check-type input string)
+  (check-type length (integer 1 *))
+  (gss--make-string-from-result (gss--internal-pseudo-random (gss-context/ptr context) input length partial)))
+
+(defclass gss-bulk-channel ()
+  ((ptr :initarg :ptr
+        :reader gss-bulk-channel/ptr)))
+
+(defvar gss-bulk-chunk-size (* 1024 1024)
+  "Largest plaintext encrypted in one chunk of a bulk channel, in bytes.
+Both peers must use the same value.")
+
+(cl-defun gss-bulk-channel (context label &key (chunk-size gss-bulk-chunk-size))
+  "Create a bulk channel keyed from the established CONTEXT.
+Data encrypted with `gss-bulk-encrypt' on one side is decrypted with
+`gss-bulk-decrypt' by a channel created from the peer's context with
+the same LABEL, a string. Channels with different labels have
+independent keys. A label must not be used twice with the same
+context, as that would repeat the nonces of AES-GCM. This is checked
+within one Emacs, but not across `gss-export-context'. The channel
+doesn't refer to CONTEXT once created."
+  (check-type context gss-context)
+  (check-type label string)
+  (check-type chunk-size (integer 1 *))
+  (make-instance 'gss-bulk-channel :ptr (gss--internal-bulk-new (gss-context/ptr context) label chunk-size)))
+
+(defun gss-bulk-encrypt (channel data)
+  "Encrypt DATA on CHANNEL and return the framed chunks to send to the peer."
+  (check-type channel gss-bulk-channel)
+  (check-type data string)
+  (gss--make-string-from-result (gss--internal-bulk-encrypt (gss-bulk-channel/ptr channel) data)))
+
+(defun gss-bulk-decrypt (channel data)
+  "Decrypt the chunks completed by DATA, received from the peer of CHANNEL.
+DATA can end in the middle of a chunk, which is kept until the rest
+arrives. Returns the plaintext of the completed chunks. A chunk which
+fails to decrypt or arrives out of sequence signals an error, after
+which the channel can't receive any more data."
+  (check-type channel gss-bulk-channel)
+  (check-type data string)
+  (gss--make-string-from-result (gss--internal-bulk-decrypt (gss-bulk-channel/ptr channel) data)))
+
+;;;
+;;;  Token traces. While a trace is active, the tokens exchanged by
+;;;  `gss-init-sec-context' and `gss-accept-sec-context' and the sizes
+;;;  of the messages passed to `gss-wrap' and `gss-unwrap' are written
+;;;  to a binary trace file, which `gss-trace-replay' can feed to an
+;;;  acceptor without a live realm.
+;;;
+
+(cl-defun gss-trace-start (file &key ring-size)
+  "Start recording a token trace to FILE.
+Records go through an in-memory ring buffer of RING-SIZE bytes, 8 MiB
+by default, and are written by a background thread. Records which
+don't fit in the ring are dropped and counted."
+  (check-type file string)
+  (check-type ring-size (or null integer))
+  (gss--internal-trace-start (expand-file-name file) ring-size))
+
+(defun gss-trace-stop ()
+  "Stop recording the active trace and return a plist of counters.
+:write-errors counts writes to the trace file which failed. If it is
+not zero, the trace is incomplete."
+  (destructuring-bind (records dropped bytes write-errors) (gss--internal-trace-stop)
+    (list :records records
+          :dropped dropped
+          :bytes bytes
+          :write-errors write-errors)))
+
+(cl-defun gss-trace-replay (file &key cred keytab paced source)
+  "Feed the tokens recorded in FILE to an acceptor.
+The acceptor uses CRED, which should have its replay cache disabled,
+or else a credential for KEYTAB or the default keytab which is
+acquired without a replay cache. If PACED is non-nil, the original
+timing of the trace is reproduced, and the replay can be interrupted
+with \\[keyboard-quit]; otherwise the trace is replayed as fast as possible.
+SOURCE selects the tokens to replay: :initiator for the tokens
+produced by `gss-init-sec-context', :acceptor for the tokens received
+by `gss-accept-sec-context', or nil for both. Use one of the first two
+when the trace contains both sides of the same handshakes.
+Returns a plist with the number of accepted tokens, failures, replayed
+wraps and skipped records, the elapsed time and the accept latency
+percentiles in seconds.
+
+The acceptor still checks authenticator timestamps and ticket end
+times, so a trace can only be replayed while its tickets are valid and
+within the clock skew allowance of krb5.conf, 300 seconds by default.
+Set a larger clockskew in [libdefaults] to replay older traces."
+  (check-type file string)
+  (check-type cred (or null gss-credential))
+  (check-type keytab (or null string))
+  (check-type source (member nil :initiator :acceptor))
+  (let ((replay-cred (or cred
+                         (gss-acquire-cred :usage :accept
+                                           :store (append (and keytab
+                                                               (list (cons "keytab" (expand-file-name keytab))))
+                                                          (list (cons "rcache" "none:")))))))
+    (unwind-protect
+        (destructuring-bind (accepts errors wraps skipped elapsed-ns p50-ns p99-ns max-ns)
+            (gss--internal-trace-replay (expand-file-name file)
+                                        (gss-credential/ptr replay-cred)
+                                        paced
+                                        (case source
+                                          (:initiator 1)
+                                          (:acceptor 2)
+                                          (t 0)))
+          (cl-flet ((seconds (ns) (and ns (/ ns 1e9))))
+            (list :accepts accepts
+                  :errors errors
+                  :wraps wraps
+                  :skipped skipped
+                  :seconds (seconds elapsed-ns)
+                  :accepts-per-second (if (zerop elapsed-ns) nil (/ accepts (seconds elapsed-ns)))
+                  :p50 (seconds p50-ns)
+                  :p99 (seconds p99-ns)
+                  :max (seconds max-ns))))
+      (unless cred
+        (gss-release-credential replay-cred)))))
+
+(defun gss-stats ()
+  "Return the performance counters of the native module.
+The result is a list with one plist per function that has been
+called. Times are in nanoseconds and split into time spent inside
+libgssapi and time spent marshaling arguments and results. The
+histograms are vectors where element N counts the calls which took
+between 2^N and 2^(N+1) nanoseconds. Returns nil if the module was
+built without statistics."
+  (loop for (name calls errors bytes-in bytes-out gss-ns marshal-ns gss-histogram marshal-histogram)
+        in (gss--internal-stats)
+        collect (list :function name
+                      :calls calls
+                      :errors errors
+                      :bytes-in bytes-in
+                      :bytes-out bytes-out
+                      :gss-ns gss-ns
+                      :marshal-ns marshal-ns
+                      :gss-histogram gss-histogram
+                      :marshal-histogram marshal-histogram)))
+
+(defun gss-stats-reset ()
+  "Reset the performance counters of the native module."
+  (gss--internal-stats-reset))
+
+(defun gss-pool-stats ()
+  "Return the counters of the native module's buffer pool as a plist.
+:mallocs counts buffers obtained from the system allocator and
+:reuses counts buffers taken from the pool instead. :in-use,
+:high-water, :cached and :limit are in bytes."
+  (destructuring-bind (mallocs reuses in-use high-water cached limit) (gss--internal-pool-stats)
+    (list :mallocs mallocs
+          :reuses reuses
+          :in-use in-use
+          :high-water high-water
+          :cached cached
+          :limit limit)))
+
+(defun gss-set-pool-limit (bytes)
+  "Limit the memory kept cached by the native module's buffer pool to BYTES.
+Cached buffers above the new limit are released immediately. A limit
+of 0 disables caching."
+  (check-type bytes (integer 0 *))
+  (gss--internal-set-pool-limit bytes))
+
 (provide 'gss)
@@ -1,14 +1,71 @@
 #include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <limits.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #include "emacs-module.h"
 #include "gssapi/gssapi.h"
 #include "gssapi/gssapi_krb5.h"
+#include "gssapi/gssapi_ext.h"
+#include <openssl/evp.h>
 
 int plugin_is_GPL_compatible;
 
+// Symbols used by the module. These are interned once when the module
+// is loaded and kept as global references.
+static emacs_value Qnil;
+static emacs_value Qt;
+static emacs_value Qlist;
+static emacs_value Qcar;
+static emacs_value Qcdr;
+static emacs_value Qcons;
+static emacs_value Qreverse;
+static emacs_value Qvconcat;
+static emacs_value Qmake_vector;
+static emacs_value Qbase64_encode_string;
+static emacs_value Qmultibyte_string_p;
+static emacs_value Qerror;
+static emacs_value Qquit;
+static emacs_value Qgss_error;
+static emacs_value Qstring;
+static emacs_value Qinteger;
+static emacs_value Qwrong_type_argument;
+static emacs_value Qevenp;
+static emacs_value Qdeleg;
+static emacs_value Qmutual;
+static emacs_value Qreplay;
+static emacs_value Qsequence;
+static emacs_value Qconf;
+static emacs_value Qinteg;
+static emacs_value Qanon;
+static emacs_value Quser_name;
+static emacs_value Qmachine_uid_name;
+static emacs_value Qstring_uid_name;
+static emacs_value Qhostbased_service;
+static emacs_value Qinitiate;
+static emacs_value Qaccept;
+static emacs_value Qboth;
+static emacs_value Qok;
+static emacs_value Qbad_sig;
+static emacs_value Qdefective_token;
+static emacs_value Qno_context;
+static emacs_value Qcontext_expired;
+static emacs_value Qbad_qop;
+static emacs_value Qfailure;
+static emacs_value Qduplicate_token;
+static emacs_value Qold_token;
+static emacs_value Qunseq_token;
+static emacs_value Qgap_token;
+
 #if 0
 static void message(emacs_env *env, char *fmt, ...)
 {
@@ -44,6 +101,58 @@ static void message(emacs_env *env, char *fmt, ...)
 }
 #endif
 
+static emacs_value make_symbol_ref(emacs_env *env, const char *name)
+{
+    return env->make_global_ref(env, env->intern(env, name));
+}
+
+static void init_symbols(emacs_env *env)
+{
+    Qnil = make_symbol_ref(env, "nil");
+    Qt = make_symbol_ref(env, "t");
+    Qlist = make_symbol_ref(env, "list");
+    Qcar = make_symbol_ref(env, "car");
+    Qcdr = make_symbol_ref(env, "cdr");
+    Qcons = make_symbol_ref(env, "cons");
+    Qreverse = make_symbol_ref(env, "reverse");
+    Qvconcat = make_symbol_ref(env, "vconcat");
+    Qmake_vector = make_symbol_ref(env, "make-vector");
+    Qbase64_encode_string = make_symbol_ref(env, "base64-encode-string");
+    Qmultibyte_string_p = make_symbol_ref(env, "multibyte-string-p");
+    Qerror = make_symbol_ref(env, "error");
+    Qquit = make_symbol_ref(env, "quit");
+    Qgss_error = make_symbol_ref(env, "gss-error");
+    Qstring = make_symbol_ref(env, "string");
+    Qinteger = make_symbol_ref(env, "integer");
+    Qwrong_type_argument = make_symbol_ref(env, "wrong-type-argument");
+    Qevenp = make_symbol_ref(env, "evenp");
+    Qdeleg = make_symbol_ref(env, ":deleg");
+    Qmutual = make_symbol_ref(env, ":mutual");
+    Qreplay = make_symbol_ref(env, ":replay");
+    Qsequence = make_symbol_ref(env, ":sequence");
+    Qconf = make_symbol_ref(env, ":conf");
+    Qinteg = make_symbol_ref(env, ":integ");
+    Qanon = make_symbol_ref(env, ":anon");
+    Quser_name = make_symbol_ref(env, ":user-name");
+    Qmachine_uid_name = make_symbol_ref(env, ":machine-uid-name");
+    Qstring_uid_name = make_symbol_ref(env, ":string-uid-name");
+    Qhostbased_service = make_symbol_ref(env, ":hostbased-service");
+    Qinitiate = make_symbol_ref(env, ":initiate");
+    Qaccept = make_symbol_ref(env, ":accept");
+    Qboth = make_symbol_ref(env, ":both");
+    Qok = make_symbol_ref(env, ":ok");
+    Qbad_sig = make_symbol_ref(env, ":bad-sig");
+    Qdefective_token = make_symbol_ref(env, ":defective-token");
+    Qno_context = make_symbol_ref(env, ":no-context");
+    Qcontext_expired = make_symbol_ref(env, ":context-expired");
+    Qbad_qop = make_symbol_ref(env, ":bad-qop");
+    Qfailure = make_symbol_ref(env, ":failure");
+    Qduplicate_token = make_symbol_ref(env, ":duplicate-token");
+    Qold_token = make_symbol_ref(env, ":old-token");
+    Qunseq_token = make_symbol_ref(env, ":unseq-token");
+    Qgap_token = make_symbol_ref(env, ":gap-token");
+}
+
 static void bind_function(emacs_env *env, char *name, emacs_value Sfun)
 {
     emacs_value Qfset = env->intern(env, "fset");
@@ -60,20 +169,208 @@ static void provide_module(emacs_env *env, const char *feature)
   env->funcall(env, Qprovide, 1, args);
 }
 
+/*
+ * Performance counters.
+ *
+ * Every function exported to Lisp is called through a trampoline which
+ * counts calls and errors and measures the total time of the call.
+ * Calls into libgssapi are bracketed with STATS_GSS_BEGIN and
+ * STATS_GSS_END, and the remainder of the time is attributed to
+ * marshaling. Build with -DGSSAPI_NO_STATS to compile this out.
+ */
+
+typedef emacs_value (*ModuleFunction)(emacs_env *env, ptrdiff_t nargs, emacs_value *args, void *data);
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#ifndef GSSAPI_NO_STATS
+
+// Bucket n counts calls which took between 2^n and 2^(n+1) nanoseconds
+#define STATS_BUCKETS 40
+
+typedef struct EntryPoint {
+    struct EntryPoint *next;
+    const char *name;
+    ModuleFunction function;
+    uint64_t calls;
+    uint64_t errors;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t gss_ns;
+    uint64_t marshal_ns;
+    uint64_t gss_histogram[STATS_BUCKETS];
+    uint64_t marshal_histogram[STATS_BUCKETS];
+} EntryPoint;
+
+static EntryPoint *entry_points = NULL;
+
+// Accumulated by the entry point which is currently running. Only
+// updated from the main thread.
+static uint64_t stats_gss_ns;
+static uint64_t stats_gss_start;
+static uint64_t stats_bytes_in;
+static uint64_t stats_bytes_out;
+
+static int stats_bucket(uint64_t ns)
+{
+    int bucket = ns == 0 ? 0 : 63 - __builtin_clzll(ns);
+    return bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1;
+}
+
+#define STATS_GSS_BEGIN() (stats_gss_start = monotonic_ns())
+#define STATS_GSS_END() (stats_gss_ns += monotonic_ns() - stats_gss_start)
+#define STATS_BYTES(in, out) (stats_bytes_in += (in), stats_bytes_out += (out))
+
+static emacs_value call_entry_point(emacs_env *env, ptrdiff_t nargs, emacs_value *args, void *data)
+{
+    EntryPoint *entry = data;
+
+    stats_gss_ns = 0;
+    stats_bytes_in = 0;
+    stats_bytes_out = 0;
+    uint64_t start = monotonic_ns();
+
+    emacs_value ret = entry->function(env, nargs, args, NULL);
+
+    uint64_t total_ns = monotonic_ns() - start;
+    uint64_t marshal_ns = total_ns > stats_gss_ns ? total_ns - stats_gss_ns : 0;
+    entry->calls++;
+    if(env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+        entry->errors++;
+    }
+    entry->bytes_in += stats_bytes_in;
+    entry->bytes_out += stats_bytes_out;
+    entry->gss_ns += stats_gss_ns;
+    entry->marshal_ns += marshal_ns;
+    if(stats_gss_ns > 0) {
+        entry->gss_histogram[stats_bucket(stats_gss_ns)]++;
+    }
+    entry->marshal_histogram[stats_bucket(marshal_ns)]++;
+
+    return ret;
+}
+
+static emacs_value make_module_function(emacs_env *env, ptrdiff_t min_arity, ptrdiff_t max_arity,
+                                        ModuleFunction function, const char *documentation, const char *name)
+{
+    EntryPoint *entry = calloc(1, sizeof(EntryPoint));
+    if(entry == NULL) {
+        return env->make_function(env, min_arity, max_arity, function, documentation, NULL);
+    }
+    entry->name = name;
+    entry->function = function;
+    entry->next = entry_points;
+    entry_points = entry;
+    return env->make_function(env, min_arity, max_arity, call_entry_point, documentation, entry);
+}
+
+static emacs_value make_histogram(emacs_env *env, uint64_t *histogram)
+{
+    emacs_value args[] = { env->make_integer(env, STATS_BUCKETS), env->make_integer(env, 0) };
+    emacs_value vector = env->funcall(env, Qmake_vector, 2, args);
+    for(int i = 0 ; i < STATS_BUCKETS ; i++) {
+        env->vec_set(env, vector, i, env->make_integer(env, histogram[i]));
+    }
+    return vector;
+}
+
+// Returns a list with one element per entry point that has been
+// called, of the form (NAME CALLS ERRORS BYTES-IN BYTES-OUT GSS-NS
+// MARSHAL-NS GSS-HISTOGRAM MARSHAL-HISTOGRAM).
+static emacs_value Fstats(emacs_env *env, ptrdiff_t nargs, emacs_value *args, void *data)
+{
+    (void)data;
+    (void)nargs;
+    (void)args;
+
+    emacs_value ret = Qnil;
+    for(EntryPoint *entry = entry_points ; entry != NULL ; entry = entry->next) {
+        if(entry->calls == 0) {
+            continue;
+        }
+        emacs_value result_list[] = { env->make_string(env, entry->name, strlen(entry->name)),
+                                      env->make_integer(env, entry->calls),
+                                      env->make_integer(env, entry->errors),
+                                      env->make_integer(env, entry->bytes_in),
+                                      env->make_integer(env, entry->bytes_out),
+                                      env->make_integer(env, entry->gss_ns),
+                                      env->make_integer(env, entry->marshal_ns),
+                                      make_histogram(env, entry->gss_histogram),
+                                      make_histogram(env, entry->marshal_histogram) };
+        emacs_value cons_args[] = { env->funcall(env, Qlist, 9, result_list), ret };
+        ret = env->funcall(env, Qcons, 2, cons_args);
+    }
+    return ret;
+}
+
+static emacs_value Fstats_reset(emacs_env *env, ptrdiff_t nargs, emacs_value *args, void *data)
+{
+    (void)env;
+    (void)data;
+    (void)nargs;
+    (void)args;
+
+    for(EntryPoint *entry = entry_points ; entry != NULL ; entry = entry->next) {
+        ModuleFunction function = entry->function;
+        const char *name = entry->name;
+        EntryPoint *next = entry->next;
+        memset(entry, 0, sizeof(EntryPoint));
+        entry->function = function;
+        entry->name = name;
+        entry->next = next;
+    }
+    return Qnil;
+}
+
+#else
+
+#define STATS_GSS_BEGIN() ((void)0)
+#define STATS_GSS_END() ((void)0)
+#define STATS_BYTES(in, out) ((void)0)
+
+static emacs_value make_module_function(emacs_env *env, ptrdiff_t min_arity, ptrdiff_t max_arity,
+                                        ModuleFunction function, const char *documentation, const char *name)
+{
+    (void)name;
+    return env->make_function(env, min_arity, max_arity, function, documentation, NULL);
+}
+
+static emacs_value Fstats(emacs_env *env, ptrdiff_t nargs, emacs_value *args, void *data)
+{
+    (void)env;
+    (void)data;
+    (void)nargs;
+    (void)args;
+    return Qnil;
+}
+
+static emacs_value Fstats_reset(emacs_env *env, ptrdiff_t nargs, emacs_value *args, void *data)
+{
+    (void)env;
+    (void)data;
+    (void)nargs;
+    (void)args;
+    return Qnil;
+}
+
+#endif
+
 static void throw_error(emacs_env *env, char *message) {
-    emacs_value error_sym = env->intern(env, "error");
     emacs_value message_value = env->make_string(env, message, strlen(message));
-    env->funcall(env, error_sym, 1, &message_value);
+    env->funcall(env, Qerror, 1, &message_value);
 }
 
 static emacs_value xcar(emacs_env *env, emacs_value obj) {
-    emacs_value Qcar = env->intern(env, "car");
     emacs_value args[] = { obj };
     return env->funcall(env, Qcar, 1, args);
 }
 
 static emacs_value xcdr(emacs_env *env, emacs_value obj) {
-    emacs_value Qcdr = env->intern(env, "cdr");
     emacs_value args[] = { obj };
     return env->funcall(env, Qcdr, 1, args);
 }
@@ -81,7 +378,6 @@ static emacs_value xcdr(emacs_env *env, emacs_value obj) {
 static emacs_value make_array(emacs_env *env, void *ptr, size_t len)
 {
     unsigned char *array_as_char = ptr;
-    emacs_value Qmake_vector = env->intern(env, "make-vector");
     emacs_value args[] = { env->make_integer(env, len), env->make_integer(env, 0) };
     emacs_value array = env->funcall(env, Qmake_vector, 2, args);
     for(size_t i = 0 ; i < len ; i++) {
@@ -90,17 +386,485 @@ static emacs_value make_array(emacs_env *env, void *ptr, size_t len)
     return array;
 }
 
+// Returns the content of a buffer as a unibyte string. Emacs versions
+// older than 28 lack make_unibyte_string, in which case the bytes are
+// returned as a vector of integers instead.
+static emacs_value make_bytes(emacs_env *env, void *ptr, size_t len)
+{
+    if(ptr == NULL) {
+        ptr = "";
+    }
+    if((size_t)env->size >= sizeof(struct emacs_env_28)) {
+        return env->make_unibyte_string(env, ptr, len);
+    }
+    else {
+        return make_array(env, ptr, len);
+    }
+}
+
+/*
+ * Buffer pool.
+ *
+ * Input tokens, payloads and other temporary buffers are drawn from a
+ * pool of size classes, so that steady wrap/unwrap load doesn't cause
+ * any allocations in the module itself. Each class holds a power of two
+ * plus some slack, so that a power-of-two payload with a terminating
+ * NUL or a small header still fits in its class. Freed buffers
+ * are kept on a free list per size class as long as the total amount
+ * of cached memory stays below pool_max_cached_bytes. Buffers larger
+ * than the largest class are allocated directly. The pool is only used
+ * from the main thread.
+ */
+
+#define POOL_MIN_SHIFT 8
+// The largest class holds 32 MiB, enough for the base64 form of a 16 MiB
+// input token
+#define POOL_CLASSES 18
+#define POOL_CLASS_SLACK 64
+
+typedef union PoolHeader {
+    struct {
+        union PoolHeader *next;
+        size_t alloc_size;
+        int size_class;
+    } h;
+    // Keeps the data following the header suitably aligned
+    max_align_t align;
+} PoolHeader;
+
+static PoolHeader *pool_free_lists[POOL_CLASSES];
+static size_t pool_max_cached_bytes = 64 * 1024 * 1024;
+static size_t pool_cached_bytes = 0;
+static size_t pool_in_use_bytes = 0;
+static size_t pool_high_water_bytes = 0;
+static uint64_t pool_mallocs = 0;
+static uint64_t pool_reuses = 0;
+
+static size_t pool_class_size(int size_class)
+{
+    return ((size_t)1 << (size_class + POOL_MIN_SHIFT)) + POOL_CLASS_SLACK;
+}
+
+static int pool_size_class(size_t size)
+{
+    int size_class = 0;
+    while(size_class < POOL_CLASSES && pool_class_size(size_class) < size) {
+        size_class++;
+    }
+    return size_class < POOL_CLASSES ? size_class : -1;
+}
+
+static void *pool_alloc(size_t size)
+{
+    int size_class = pool_size_class(size);
+    size_t alloc_size = size_class < 0 ? size : pool_class_size(size_class);
+    PoolHeader *header;
+
+    if(size_class >= 0 && pool_free_lists[size_class] != NULL) {
+        header = pool_free_lists[size_class];
+        pool_free_lists[size_class] = header->h.next;
+        pool_cached_bytes -= alloc_size;
+        pool_reuses++;
+    }
+    else {
+        header = malloc(sizeof(PoolHeader) + alloc_size);
+        if(header == NULL) {
+            return NULL;
+        }
+        pool_mallocs++;
+    }
+
+    header->h.size_class = size_class;
+    header->h.alloc_size = alloc_size;
+    pool_in_use_bytes += alloc_size;
+    if(pool_in_use_bytes > pool_high_water_bytes) {
+        pool_high_water_bytes = pool_in_use_bytes;
+    }
+    return header + 1;
+}
+
+static void pool_free(void *ptr)
+{
+    if(ptr == NULL) {
+        return;
+    }
+
+    PoolHeader *header = (PoolHeader *)ptr - 1;
+    int size_class = header->h.size_class;
+    size_t alloc_size = header->h.alloc_size;
+    pool_in_use_bytes -= alloc_size;
+
+    if(size_class < 0 || pool_cached_bytes + alloc_size > pool_max_cached_bytes) {
+        free(header);
+        return;
+    }
+
+    header->h.next = pool_free_lists[size_class];
+    pool_free_lists[size_class] = header;
+    pool_cached_bytes += alloc_size;
+}
+
+static void pool_trim(void)
+{
+    for(int i = 0 ; i < POOL_CLASSES ; i++) {
+        while(pool_free_lists[i] != NULL && pool_cached_bytes > pool_max_cached_bytes) {
+            PoolHeader *header = pool_free_lists[i];
+            pool_free_lists[i] = header->h.next;
+            pool_cached_bytes -= pool_class_size(i);
+            free(header);
+        }
+    }
+}
+
+// Returns a NUL-terminated copy of a Lisp string, allocated from the
+// pool. The result must be released with pool_free.
+static char *copy_string(emacs_env *env, emacs_value string)
+{
+    ptrdiff_t size;
+    if(!env->copy_string_contents(env, string, NULL, &size)) {
+        return NULL;
+    }
+    char *buf = pool_alloc(size);
+    if(buf == NULL) {
+        throw_error(env, "out of memory");
+        return NULL;
+    }
+    if(!env->copy_string_contents(env, string, buf, &size)) {
+        pool_free(buf);
+        return NULL;
+    }
+    return buf;
+}
+
+// Grows BUF so that it can hold SIZE bytes, preserving its first LENGTH
+// bytes.
+static int grow_buffer(unsigned char **buf, size_t *buf_size, size_t length, size_t size)
+{
+    if(size <= *buf_size) {
+        return 1;
+    }
+    size_t new_size = *buf_size < 256 ? 256 : *buf_size;
+    while(new_size < size) {
+        new_size *= 2;
+    }
+    unsigned char *new_buf = pool_alloc(new_size);
+    if(new_buf == NULL) {
+        return 0;
+    }
+    if(length > 0) {
+        memcpy(new_buf, *buf, length);
+    }
+    pool_free(*buf);
+    *buf = new_buf;
+    *buf_size = new_size;
+    return 1;
+}
+
+// Returns (MALLOCS REUSES IN-USE HIGH-WATER CACHED LIMIT), where the
+// last four are byte counts.
+static emacs_value Fpool_stats(emacs_env *env, ptrdiff_t nargs, emacs_value *args, void *data)
+{
+    (void)data;
+    (void)nargs;
+    (void)args;
+
+    emacs_value result_list[] = { env->make_integer(env, pool_mallocs),
+                                  env->make_integer(env, pool_reuses),
+                                  env->make_integer(env, pool_in_use_bytes),
+                                  env->make_integer(env, pool_high_water_bytes),
+                                  env->make_integer(env, pool_cached_bytes),
+                                  env->make_integer(env, pool_max_cached_bytes) };
+    return env->funcall(env, Qlist, 6, result_list);
+}
+
+// Sets the maximum number of bytes kept on the free lists and releases
+// any cached buffers above the new limit. The high-water mark is left
+// alone.
+static emacs_value Fset_pool_limit(emacs_env *env, ptrdiff_t nargs, emacs_value *args, void *data)
+{
+    (void)data;
+    (void)nargs;
+
+    intmax_t limit = env->extract_integer(env, args[0]);
+    if(env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+        return Qnil;
+    }
+    if(limit < 0) {
+        throw_error(env, "pool limit must not be negative");
+        return Qnil;
+    }
+
+    pool_max_cached_bytes = (size_t)limit;
+    pool_trim();
+    return Qnil;
+}
+
+/*
+ * Token tracing.
+ *
+ * When a trace is active, the context establishment calls record their
+ * input and output tokens, and wrap and unwrap record the size of the
+ * messages. Records are appended to a single-producer ring buffer by
+ * the main thread without taking a lock, and a writer thread drains the
+ * ring to the trace file. If the ring is full the record is dropped and
+ * counted. gss--internal-trace-replay feeds the tokens of a trace to an
+ * acceptor.
+ *
+ * The file starts with TRACE_MAGIC, followed by a 32-bit version and a
+ * 32-bit byte order marker, and then the records. Each record is a
+ * TraceRecord followed by IN_LENGTH bytes of input token and
+ * OUT_LENGTH bytes of output token. Wrap and unwrap records only carry
+ * the lengths. Integers are in native byte order.
+ */
+
+#define TRACE_MAGIC "GSSTRACE"
+#define TRACE_VERSION 1
+#define TRACE_BYTE_ORDER 0x01020304
+#define TRACE_DEFAULT_RING_SIZE (8 * 1024 * 1024)
+
+enum {
+    TRACE_INIT = 1,
+    TRACE_ACCEPT = 2,
+    TRACE_WRAP = 3,
+    TRACE_UNWRAP = 4
+};
+
+#define TRACE_FLAG_CONF 1
+// The call started a new context
+#define TRACE_FLAG_NEW 2
+
+typedef struct {
+    uint8_t type;
+    uint8_t flags;
+    uint16_t reserved;
+    uint32_t major;
+    uint64_t time_ns;
+    // The context handle, used to match the legs of a handshake
+    uint64_t context_id;
+    uint32_t in_length;
+    uint32_t out_length;
+} TraceRecord;
+
+static unsigned char *trace_ring = NULL;
+static size_t trace_ring_size = 0;
+static _Atomic size_t trace_head = 0;
+static _Atomic size_t trace_tail = 0;
+static atomic_int trace_stop = 0;
+static int trace_active = 0;
+static FILE *trace_file = NULL;
+static pthread_t trace_thread;
+static uint64_t trace_start_ns;
+static uint64_t trace_records = 0;
+static uint64_t trace_dropped = 0;
+static uint64_t trace_bytes = 0;
+// Failed writes to the trace file. Only updated by the writer thread
+// while a trace is active, and by stop_trace.
+static uint64_t trace_write_errors = 0;
+
+static void trace_copy_in(size_t position, const void *data, size_t length)
+{
+    size_t offset = position & (trace_ring_size - 1);
+    size_t first = trace_ring_size - offset < length ? trace_ring_size - offset : length;
+    memcpy(trace_ring + offset, data, first);
+    memcpy(trace_ring, (const unsigned char *)data + first, length - first);
+}
+
+static void trace_record(int type, int flags, OM_uint32 major, gss_ctx_id_t context,
+                         const gss_buffer_desc *in, size_t in_length,
+                         const gss_buffer_desc *out, size_t out_length)
+{
+    TraceRecord record = { type, flags, 0, major, monotonic_ns() - trace_start_ns, (uintptr_t)context,
+                           in_length, out_length };
+    size_t in_bytes = in == NULL ? 0 : in->length;
+    size_t out_bytes = out == NULL ? 0 : out->length;
+    size_t length = sizeof(TraceRecord) + in_bytes + out_bytes;
+
+    size_t head = atomic_load_explicit(&trace_head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&trace_tail, memory_order_acquire);
+    if(trace_ring_size - (head - tail) < length) {
+        trace_dropped++;
+        return;
+    }
+
+    trace_copy_in(head, &record, sizeof(TraceRecord));
+    if(in_bytes > 0) {
+        trace_copy_in(head + sizeof(TraceRecord), in->value, in_bytes);
+    }
+    if(out_bytes > 0) {
+        trace_copy_in(head + sizeof(TraceRecord) + in_bytes, out->value, out_bytes);
+    }
+    atomic_store_explicit(&trace_head, head + length, memory_order_release);
+    trace_records++;
+    trace_bytes += length;
+}
+
+// Records a context establishment call with its tokens. OUT is NULL
+// if the call failed.
+#define TRACE_TOKENS(type, is_new, major, context, in, out)             \
+    do {                                                                \
+        if(trace_active) {                                              \
+            const gss_buffer_desc *trace_out = (out);                   \
+            trace_record((type), (is_new) ? TRACE_FLAG_NEW : 0, (major), (context), \
+                         (in), (in)->length, trace_out, trace_out == NULL ? 0 : trace_out->length); \
+        }                                                               \
+    } while(0)
+
+// Records a per-message call with the sizes of its input and output
+#define TRACE_SIZES(type, conf, major, context, in_length, out_length)  \
+    do {                                                                \
+        if(trace_active) {                                              \
+            trace_record((type), (conf) ? TRACE_FLAG_CONF : 0, (major), (context), \
+                         NULL, (in_length), NULL, (out_length));        \
+        }                                                               \
+    } while(0)
+
+static void *trace_writer(void *arg)
+{
+    (void)arg;
+
+    for(;;) {
+        size_t tail = atomic_load_explicit(&trace_tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&trace_head, memory_order_acquire);
+        if(head == tail) {
+            if(atomic_load(&trace_stop)) {
+                break;
+            }
+            struct timespec delay = { 0, 1000000 };
+            nanosleep(&delay, NULL);
+            continue;
+        }
+        size_t offset = tail & (trace_ring_size - 1);
+        size_t length = head - tail;
+        if(length > trace_ring_size - offset) {
+            length = trace_ring_size - offset;
+        }
+        // Data which can't be written is dropped, so that the ring keeps
+        // draining
+        if(fwrite(trace_ring + offset, 1, length, trace_file) != length) {
+            trace_write_errors++;
+        }
+        atomic_store_explicit(&trace_tail, tail + length, memory_order_release);
+    }
+
+    return NULL;
+}
+
+static void stop_trace(void)
+{
+    if(!trace_active) {
+        return;
+    }
+    trace_active = 0;
+    atomic_store(&trace_stop, 1);
+    pthread_join(trace_thread, NULL);
+    if(fclose(trace_file) != 0) {
+        trace_write_errors++;
+    }
+    trace_file = NULL;
+    free(trace_ring);
+    trace_ring = NULL;
+}
+
+// Takes the name of the trace file and the size of the ring buffer in
+// bytes, or nil for the default. The size is rounded up to a power of
+// two.
+static emacs_value Ftrace_start(emacs_env *env, ptrdiff_t nargs, emacs_value *args, void *data)
+{
+    (void)data;
+    (void)nargs;
+
+    if(trace_active) {
+        throw_error(env, "a trace is already active");
+        return Qnil;
+    }
+
+    intmax_t ring_size = env->is_not_nil(env, args[1]) ? env->extract_integer(env, args[1]) : TRACE_DEFAULT_RING_SIZE;
+    if(env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+        return Qnil;
+    }
+    if(ring_size < 4096) {
+        throw_error(env, "trace ring buffer is too small");
+        return Qnil;
+    }
+    size_t size = 4096;
+    while(size < (size_t)ring_size) {
+        size *= 2;
+    }
+
+    char *filename = copy_string(env, args[0]);
+    if(filename == NULL) {
+        return Qnil;
+    }
+    FILE *file = fopen(filename, "wb");
+    pool_free(filename);
+    if(file == NULL) {
+        throw_error(env, "unable to open trace file");
+        return Qnil;
+    }
+
+    uint32_t header[] = { TRACE_VERSION, TRACE_BYTE_ORDER };
+    if(fwrite(TRACE_MAGIC, 1, strlen(TRACE_MAGIC), file) != strlen(TRACE_MAGIC)
+       || fwrite(header, sizeof(header), 1, file) != 1) {
+        fclose(file);
+        throw_error(env, "unable to write trace file");
+        return Qnil;
+    }
+
+    trace_ring = malloc(size);
+    if(trace_ring == NULL) {
+        fclose(file);
+        throw_error(env, "out of memory");
+        return Qnil;
+    }
+    trace_ring_size = size;
+    trace_file = file;
+    atomic_store(&trace_head, 0);
+    atomic_store(&trace_tail, 0);
+    atomic_store(&trace_stop, 0);
+    trace_records = 0;
+    trace_dropped = 0;
+    trace_bytes = 0;
+    trace_write_errors = 0;
+    trace_start_ns = monotonic_ns();
+
+    if(pthread_create(&trace_thread, NULL, trace_writer, NULL) != 0) {
+        fclose(file);
+        trace_file = NULL;
+        free(trace_ring);
+        trace_ring = NULL;
+        throw_error(env, "unable to start the trace writer");
+        return Qnil;
+    }
+    trace_active = 1;
+    return Qnil;
+}
+
+// Stops the active trace, if any, after writing out the pending
+// records. Returns (RECORDS DROPPED BYTES WRITE-ERRORS), where
+// WRITE-ERRORS counts writes to the trace file which failed, including
+// closing it.
+static emacs_value Ftrace_stop(emacs_env *env, ptrdiff_t nargs, emacs_value *args, void *data)
+{
+    (void)data;
+    (void)nargs;
+    (void)args;
+
+    stop_trace();
+    emacs_value result_list[] = { env->make_integer(env, trace_records),
+                                  env->make_integer(env, trace_dropped),
+                                  env->make_integer(env, trace_bytes),
+                                  env->make_integer(env, trace_write_errors) };
+    return env->funcall(env, Qlist, 4, result_list);
+}
+
 static emacs_value xcons(emacs_env *env, emacs_value x, emacs_value y)
 {
-   emacs_value Qcons = env->intern(env, "cons");
    emacs_value args[] = { x, y };
    return env->funcall(env, Qcons, 2, args);
 }
 
 static emacs_value extract_error_message(emacs_env *env, OM_uint32 status, int status_code_type, const gss_OID mech)
 {
-    emacs_value Qnil = env->intern(env, "nil");
-    emacs_value Qreverse = env->intern(env, "reverse");
     emacs_value messages = Qnil;
 
     OM_uint32 message_context = 0;
@@ -109,13 +873,14 @@ static emacs_value extract_error_message(emacs_env *env, OM_uint32 status, int s
         OM_uint32 minor;
         OM_uint32 result = gss_display_status(&minor, status, status_code_type, mech, &message_context, &status_output);
         if(GSS_ERROR(result)) {
-            abort();
+            throw_error(env, "unable to display status");
+            return Qnil;
         }
 
         messages = xcons(env, env->make_string(env, status_output.value, status_output.length), messages);
-        result = gss_release_buffer(&minor, &status_output);
-        if(GSS_ERROR(result)) {
-            abort();
+        gss_release_buffer(&minor, &status_output);
+        if(env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+            return Qnil;
         }
     } while(message_context != 0);
 
@@ -123,34 +888,57 @@ static emacs_value extract_error_message(emacs_env *env, OM_uint32 status, int s
     return messages;
 }
 
-static int check_error(emacs_env *env, OM_uint32 major_status, OM_uint32 minor_status)
+// The error data is kept cheap to construct, since errors may be
+// frequent when a peer sends bad tokens. The messages are rendered by
+// gss--internal-display-status only when they are needed.
+static emacs_value make_error_data(emacs_env *env, OM_uint32 major_status, OM_uint32 minor_status, const gss_OID mech)
+{
+    emacs_value list_args[] = { env->make_integer(env, major_status),
+                                env->make_integer(env, minor_status),
+                                env->make_integer(env, GSS_ROUTINE_ERROR(major_status) >> GSS_C_ROUTINE_ERROR_OFFSET),
+                                env->make_integer(env, GSS_CALLING_ERROR(major_status) >> GSS_C_CALLING_ERROR_OFFSET),
+                                env->make_integer(env, GSS_SUPPLEMENTARY_INFO(major_status)),
+                                mech == GSS_C_NO_OID ? Qnil : make_bytes(env, mech->elements, mech->length) };
+    return env->funcall(env, Qlist, 6, list_args);
+}
+
+static int check_error_mech(emacs_env *env, OM_uint32 major_status, OM_uint32 minor_status, const gss_OID mech)
 {
     if(!GSS_ERROR(major_status)) {
         return 0;
     }
 
-    emacs_value major_messages = extract_error_message(env, major_status, GSS_C_GSS_CODE, GSS_C_NO_OID);
-    emacs_value minor_messages;
-    if(GSS_ERROR(minor_status)) {
-        minor_messages = extract_error_message(env, minor_status, GSS_C_MECH_CODE, (gss_OID)gss_mech_krb5);
-    }
-    else {
-        minor_messages = env->intern(env, "nil");
-    }
-
-    emacs_value Qlist = env->intern(env, "list");
-    emacs_value list_args[] = { major_messages, minor_messages };
-    emacs_value error_list = env->funcall(env, Qlist, 2, list_args);
-    env->non_local_exit_throw(env, env->intern(env, "gss-error"), error_list);
+    env->non_local_exit_signal(env, Qgss_error, make_error_data(env, major_status, minor_status, mech));
 
     return 1;
 }
 
+static int check_error(emacs_env *env, OM_uint32 major_status, OM_uint32 minor_status)
+{
+    return check_error_mech(env, major_status, minor_status, GSS_C_NO_OID);
+}
+
 char *crash_status = NULL;
 char *crash_status_minor = NULL;
+
+/*
+ * Registry of the native handles currently owned by Lisp objects. A
+ * handle stops being live when it is released explicitly or when its
+ * user pointer is finalized, whichever comes first. Only updated from
+ * the main thread.
+ */
+static intmax_t live_names = 0;
+static intmax_t live_contexts = 0;
+static intmax_t live_creds = 0;
+static intmax_t live_handle_bytes = 0;
+
 static void release_name(void *name_ptr)
 {
     gss_name_t name = name_ptr;
+    if(name == GSS_C_NO_NAME) {
+        return;
+    }
+    live_names--;
     OM_uint32 minor;
     OM_uint32 result = gss_release_name(&minor, &name);
     if(GSS_ERROR(result)) {
@@ -167,16 +955,47 @@ static void release_name(void *name_ptr)
     }
 }
 
+typedef struct BulkLabel {
+    struct BulkLabel *next;
+    size_t length;
+    unsigned char label[];
+} BulkLabel;
+
 typedef struct {
     gss_ctx_id_t context;
     int is_released;
+    // Set while an asynchronous request owns the context handle
+    int is_busy;
+    // Labels of the bulk channels created from the context
+    BulkLabel *bulk_labels;
 } ContextWrapper;
 
+// Marks the context as no longer owned by the wrapper, either because
+// it has been deleted or because the library has already released it.
+static void mark_context_released(ContextWrapper *context_wrapper)
+{
+    if(!context_wrapper->is_released) {
+        context_wrapper->is_released = 1;
+        context_wrapper->context = GSS_C_NO_CONTEXT;
+        live_contexts--;
+    }
+}
+
+static void free_bulk_labels(BulkLabel *label)
+{
+    while(label != NULL) {
+        BulkLabel *next = label->next;
+        free(label);
+        label = next;
+    }
+}
+
 static void free_context(void *context_ptr)
 {
     ContextWrapper *context_wrapper = context_ptr;
 
     if(!context_wrapper->is_released) {
+        live_contexts--;
         gss_buffer_desc output;
         OM_uint32 minor;
         gss_ctx_id_t context_id = context_wrapper->context;
@@ -203,42 +1022,301 @@ static void free_context(void *context_ptr)
         }
     }
 
+    free_bulk_labels(context_wrapper->bulk_labels);
+    live_handle_bytes -= sizeof(ContextWrapper);
     free(context_wrapper);
 }
 
-static emacs_value Fgssapi_internal_import_name(emacs_env *env, ptrdiff_t nargs, emacs_value *args, void *data)
+static void release_cred(void *cred_ptr)
 {
-    // Deal with unused variable warning
-    (void)data;
-    (void)nargs;
-
-    emacs_value name = args[0];
-    emacs_value type = args[1];
-
+    gss_cred_id_t cred = cred_ptr;
+    if(cred == GSS_C_NO_CREDENTIAL) {
+        return;
+    }
+    live_creds--;
+    OM_uint32 minor;
+    OM_uint32 result = gss_release_cred(&minor, &cred);
+    if(GSS_ERROR(result)) {
+        abort();
+    }
+}
+
+/*
+ * Handles pinned by asynchronous requests.
+ *
+ * A name or credential passed to a request running on a worker thread
+ * must stay valid until the request has been collected, even if it is
+ * released explicitly from Lisp in the meantime. Such a release is
+ * recorded here and carried out when the last request using the handle
+ * is freed. The table is only accessed from the main thread.
+ */
+
+typedef struct PinnedHandle {
+    struct PinnedHandle *next;
+    void *handle;
+    int is_cred;
+    int count;
+    // Set when the handle was released while it was pinned
+    int release_pending;
+} PinnedHandle;
+
+static PinnedHandle *pinned_handles = NULL;
+
+static PinnedHandle **find_pinned_handle(void *handle)
+{
+    PinnedHandle **p = &pinned_handles;
+    while(*p != NULL && (*p)->handle != handle) {
+        p = &(*p)->next;
+    }
+    return p;
+}
+
+// Returns zero if the pin could not be allocated
+static int pin_handle(void *handle, int is_cred)
+{
+    if(handle == NULL) {
+        return 1;
+    }
+    PinnedHandle **p = find_pinned_handle(handle);
+    if(*p == NULL) {
+        PinnedHandle *pin = calloc(1, sizeof(PinnedHandle));
+        if(pin == NULL) {
+            return 0;
+        }
+        pin->handle = handle;
+        pin->is_cred = is_cred;
+        *p = pin;
+    }
+    (*p)->count++;
+    return 1;
+}
+
+static void unpin_handle(void *handle)
+{
+    if(handle == NULL) {
+        return;
+    }
+    PinnedHandle **p = find_pinned_handle(handle);
+    PinnedHandle *pin = *p;
+    if(pin == NULL || --pin->count > 0) {
+        return;
+    }
+    *p = pin->next;
+    if(pin->release_pending) {
+        OM_uint32 minor;
+        if(pin->is_cred) {
+            gss_cred_id_t cred = handle;
+            gss_release_cred(&minor, &cred);
+        }
+        else {
+            gss_name_t name = handle;
+            gss_release_name(&minor, &name);
+        }
+    }
+    free(pin);
+}
+
+// Returns non-zero if HANDLE is pinned, in which case it will be
+// released when it is unpinned instead of by the caller.
+static int defer_release(void *handle)
+{
+    PinnedHandle *pin = *find_pinned_handle(handle);
+    if(pin == NULL) {
+        return 0;
+    }
+    pin->release_pending = 1;
+    return 1;
+}
+
+static emacs_value make_name_ptr(emacs_env *env, gss_name_t name)
+{
+    if(name == GSS_C_NO_NAME) {
+        return Qnil;
+    }
+    live_names++;
+    return env->make_user_ptr(env, release_name, name);
+}
+
+static emacs_value make_context_ptr(emacs_env *env, gss_ctx_id_t context)
+{
+    ContextWrapper *context_wrapper = malloc(sizeof(ContextWrapper));
+    if(context_wrapper == NULL) {
+        OM_uint32 minor;
+        gss_delete_sec_context(&minor, &context, GSS_C_NO_BUFFER);
+        throw_error(env, "out of memory");
+        return Qnil;
+    }
+    context_wrapper->context = context;
+    context_wrapper->is_released = 0;
+    context_wrapper->is_busy = 0;
+    context_wrapper->bulk_labels = NULL;
+    live_contexts++;
+    live_handle_bytes += sizeof(ContextWrapper);
+    return env->make_user_ptr(env, free_context, context_wrapper);
+}
+
+static emacs_value make_cred_ptr(emacs_env *env, gss_cred_id_t cred)
+{
+    live_creds++;
+    return env->make_user_ptr(env, release_cred, cred);
+}
+
+// Deletes the context immediately instead of waiting for the garbage
+// collector. Deleting a context which has already been released is a
+// no-op, and any other use of it signals "context has been released"
+// through make_context_ref. A context used by an asynchronous request is deleted when the
+// request is collected, and its result is reported as cancelled.
+static emacs_value Fdelete_sec_context(emacs_env *env, ptrdiff_t nargs, emacs_value *args, void *data)
+{
+    (void)data;
+    (void)nargs;
+
+    ContextWrapper *context_wrapper = env->get_user_ptr(env, args[0]);
+    if(context_wrapper == NULL || context_wrapper->is_released) {
+        return Qnil;
+    }
+    if(context_wrapper->is_busy) {
+        mark_context_released(context_wrapper);
+        return Qnil;
+    }
+
+    gss_ctx_id_t context_handle = context_wrapper->context;
+    OM_uint32 minor;
+    STATS_GSS_BEGIN();
+    OM_uint32 result = gss_delete_sec_context(&minor, &context_handle, GSS_C_NO_BUFFER);
+    STATS_GSS_END();
+    mark_context_released(context_wrapper);
+    if(check_error(env, result, minor)) {
+        return Qnil;
+    }
+    return Qnil;
+}
+
+// Releases the name immediately instead of waiting for the garbage
+// collector. If an asynchronous request or a batch accept is using the
+// name, it is released when the last of them has finished.
+static emacs_value Frelease_name(emacs_env *env, ptrdiff_t nargs, emacs_value *args, void *data)
+{
+    (void)data;
+    (void)nargs;
+
+    gss_name_t name = env->get_user_ptr(env, args[0]);
+    if(name == GSS_C_NO_NAME) {
+        return Qnil;
+    }
+    env->set_user_ptr(env, args[0], GSS_C_NO_NAME);
+    live_names--;
+    if(defer_release(name)) {
+        return Qnil;
+    }
+
+    OM_uint32 minor;
+    STATS_GSS_BEGIN();
+    OM_uint32 result = gss_release_name(&minor, &name);
+    STATS_GSS_END();
+    if(check_error(env, result, minor)) {
+        return Qnil;
+    }
+    return Qnil;
+}
+
+// Like gss--internal-release-name, for credentials
+static emacs_value Frelease_cred(emacs_env *env, ptrdiff_t nargs, emacs_value *args, void *data)
+{
+    (void)data;
+    (void)nargs;
+
+    gss_cred_id_t cred = env->get_user_ptr(env, args[0]);
+    if(cred == GSS_C_NO_CREDENTIAL) {
+        return Qnil;
+    }
+    env->set_user_ptr(env, args[0], GSS_C_NO_CREDENTIAL);
+    live_creds--;
+    if(defer_release(cred)) {
+        return Qnil;
+    }
+
+    OM_uint32 minor;
+    STATS_GSS_BEGIN();
+    OM_uint32 result = gss_release_cred(&minor, &cred);
+    STATS_GSS_END();
+    if(check_error(env, result, minor)) {
+        return Qnil;
+    }
+    return Qnil;
+}
+
+// Returns (NAMES CONTEXTS CREDS BYTES), the number of live handles of
+// each kind and the number of bytes allocated by the module for them.
+// Memory held inside the GSSAPI library is not included.
+static emacs_value Flive_handles(emacs_env *env, ptrdiff_t nargs, emacs_value *args, void *data)
+{
+    (void)data;
+    (void)nargs;
+    (void)args;
+
+    emacs_value result_list[] = { env->make_integer(env, live_names),
+                                  env->make_integer(env, live_contexts),
+                                  env->make_integer(env, live_creds),
+                                  env->make_integer(env, live_handle_bytes) };
+    return env->funcall(env, Qlist, 4, result_list);
+}
+
+// Symbols which were interned on every call before they were kept as
+// global references. Only used to measure the cost of those lookups.
+static const char *per_call_symbols[] = {
+    "nil", "t", "list", "car", "cdr", "cons", "reverse", "make-vector",
+    ":deleg", ":mutual", ":replay", ":sequence", ":conf", ":integ", ":anon"
+};
+
+// Takes a count and interns the symbols above that many times
+static emacs_value Fbench_intern(emacs_env *env, ptrdiff_t nargs, emacs_value *args, void *data)
+{
+    (void)data;
+    (void)nargs;
+
+    intmax_t count = env->extract_integer(env, args[0]);
+    if(env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+        return Qnil;
+    }
+    for(intmax_t i = 0 ; i < count ; i++) {
+        for(size_t j = 0 ; j < sizeof(per_call_symbols) / sizeof(per_call_symbols[0]) ; j++) {
+            env->intern(env, per_call_symbols[j]);
+        }
+    }
+    return Qnil;
+}
+
+static emacs_value Fgssapi_internal_import_name(emacs_env *env, ptrdiff_t nargs, emacs_value *args, void *data)
+{
+    // Deal with unused variable warning
+    (void)data;
+    (void)nargs;
+
+    emacs_value name = args[0];
+    emacs_value type = args[1];
+
     gss_OID_desc *gss_type;
-    if(env->eq(env, type, env->intern(env, ":user-name"))) {
+    if(env->eq(env, type, Quser_name)) {
         gss_type = GSS_C_NT_USER_NAME;
     }
-    else if(env->eq(env, type, env->intern(env, ":machine-uid-name"))) {
+    else if(env->eq(env, type, Qmachine_uid_name)) {
         gss_type = GSS_C_NT_MACHINE_UID_NAME;
     }
-    else if(env->eq(env, type, env->intern(env, ":string-uid-name"))) {
+    else if(env->eq(env, type, Qstring_uid_name)) {
         gss_type = GSS_C_NT_STRING_UID_NAME;
     }
-    else if(env->eq(env, type, env->intern(env, ":hostbased-service"))) {
+    else if(env->eq(env, type, Qhostbased_service)) {
         gss_type = GSS_C_NT_HOSTBASED_SERVICE;
     }
     else {
         throw_error(env, "illegal type");
-        return env->intern(env, "nil");
+        return Qnil;
     }
 
-    ptrdiff_t size;
-    env->copy_string_contents(env, name, NULL, &size);
-    char *buf = malloc(size);
-    if(!env->copy_string_contents(env, name, buf, &size)) {
-        throw_error(env, "unable to copy string");
-        return env->intern(env, "nil");
+    char *buf = copy_string(env, name);
+    if(buf == NULL) {
+        return Qnil;
     }
 
     gss_name_t output_name;
@@ -246,14 +1324,15 @@ static emacs_value Fgssapi_internal_import_name(emacs_env *env, ptrdiff_t nargs,
     gss_buffer_desc name_buf;
     name_buf.value = buf;
     name_buf.length = strlen(buf);
+    STATS_GSS_BEGIN();
     OM_uint32 result = gss_import_name(&minor, &name_buf, gss_type, &output_name);
+    STATS_GSS_END();
+    pool_free(buf);
     if(check_error(env, result, minor)) {
-        return env->intern(env, "nil");
+        return Qnil;
     }
 
-    free(buf);
-
-    return env->make_user_ptr(env, release_name, output_name);
+    return make_name_ptr(env, output_name);
 }
 
 static emacs_value Fgssapi_internal_name_to_string(emacs_env *env, ptrdiff_t nargs, emacs_value *args, void *data)
@@ -267,9 +1346,11 @@ static emacs_value Fgssapi_internal_name_to_string(emacs_env *env, ptrdiff_t nar
     gss_OID type;
 
     OM_uint32 minor;
+    STATS_GSS_BEGIN();
     OM_uint32 result = gss_display_name(&minor, env->get_user_ptr(env, name), &buffer, &type);
+    STATS_GSS_END();
     if(check_error(env, result, minor)) {
-        return env->intern(env, "nil");
+        return Qnil;
     }
 
     emacs_value ret = env->make_string(env, buffer.value, buffer.length);
@@ -278,30 +1359,52 @@ static emacs_value Fgssapi_internal_name_to_string(emacs_env *env, ptrdiff_t nar
     result = gss_release_oid(&minor, &type);
     if(!release_buffer_error) {
         if(check_error(env, result, minor)) {
-            return env->intern(env, "nil");
+            return Qnil;
         }
     }
     else {
-        return env->intern(env, "nil");
+        return Qnil;
     }
 
     return ret;
 }
 
+static emacs_value Fgssapi_internal_canonicalize_name(emacs_env *env, ptrdiff_t nargs, emacs_value *args, void *data)
+{
+    (void)data;
+    (void)nargs;
+
+    emacs_value name = args[0];
+
+    gss_name_t output_name;
+    OM_uint32 minor;
+    STATS_GSS_BEGIN();
+    OM_uint32 result = gss_canonicalize_name(&minor, env->get_user_ptr(env, name), (gss_OID)gss_mech_krb5, &output_name);
+    STATS_GSS_END();
+    if(check_error(env, result, minor)) {
+        return Qnil;
+    }
+
+    return make_name_ptr(env, output_name);
+}
+
 static OM_uint32 make_flags(emacs_env *env, emacs_value flags)
 {
-    emacs_value Qdeleg = env->intern(env, ":deleg");
-    emacs_value Qmutual = env->intern(env, ":mutual");
-    emacs_value Qreplay = env->intern(env, ":replay");
-    emacs_value Qsequence = env->intern(env, ":sequence");
-    emacs_value Qconf = env->intern(env, ":conf");
-    emacs_value Qinteg = env->intern(env, ":integ");
-    emacs_value Qanon = env->intern(env, ":anon");
-    
+    // The common case is a bitmask computed by gss.el
+    if(env->eq(env, env->type_of(env, flags), Qinteger)) {
+        return env->extract_integer(env, flags);
+    }
+
+    // A keyword list is turned into a vector with a single call, so that
+    // its elements can be read without calling back into Lisp for each
+    emacs_value flags_vec = env->funcall(env, Qvconcat, 1, &flags);
+    if(env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+        return 0;
+    }
     OM_uint32 result = 0;
-    emacs_value curr = flags;
-    while(env->is_not_nil(env, curr)) {
-        emacs_value v = xcar(env, curr);
+    ptrdiff_t n = env->vec_size(env, flags_vec);
+    for(ptrdiff_t i = 0 ; i < n ; i++) {
+        emacs_value v = env->vec_get(env, flags_vec, i);
         if(env->eq(env, v, Qdeleg)) {
             result |= GSS_C_DELEG_FLAG;
         }
@@ -323,184 +1426,661 @@ static OM_uint32 make_flags(emacs_env *env, emacs_value flags)
         else if(env->eq(env, v, Qanon)) {
             result |= GSS_C_ANON_FLAG;
         }
-        curr = xcdr(env, curr);
     }
     return result;
 }
 
-static emacs_value parse_flags(emacs_env *env, OM_uint32 flags)
+static gss_ctx_id_t make_context_ref(emacs_env *env, emacs_value context)
 {
-    emacs_value res = env->intern(env, "nil");
-    if(flags & GSS_C_DELEG_FLAG) {
-        res = xcons(env, env->intern(env, ":deleg"), res);
-    }
-    if(flags & GSS_C_MUTUAL_FLAG) {
-        res = xcons(env, env->intern(env, ":mutual"), res);
-    }
-    if(flags & GSS_C_REPLAY_FLAG) {
-        res = xcons(env, env->intern(env, ":replay"), res);
+    if(env->is_not_nil(env, context)) {
+        ContextWrapper *w = env->get_user_ptr(env, context);
+        if(w != NULL && w->is_released) {
+            throw_error(env, "context has been released");
+            return GSS_C_NO_CONTEXT;
+        }
+        if(w != NULL && w->is_busy) {
+            throw_error(env, "context is in use by an asynchronous request");
+            return GSS_C_NO_CONTEXT;
+        }
+        return w == NULL ? GSS_C_NO_CONTEXT : w->context;
     }
-    if(flags & GSS_C_SEQUENCE_FLAG) {
-        res = xcons(env, env->intern(env, ":sequence"), res);
+    else {
+        return GSS_C_NO_CONTEXT;
     }
-    if(flags & GSS_C_CONF_FLAG) {
-        res = xcons(env, env->intern(env, ":conf"), res);
+}
+
+/*
+ * Base64 codec used for HTTP Negotiate headers. The encoder emits two
+ * characters per table lookup, and the decoder checks a whole quantum
+ * for invalid characters with a single test.
+ */
+
+static const char base64_alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static char base64_pairs[4096][2];
+static uint32_t base64_decode_table[256];
+
+#define BASE64_INVALID 0x80000000u
+
+static void init_base64(void)
+{
+    for(int i = 0 ; i < 4096 ; i++) {
+        base64_pairs[i][0] = base64_alphabet[i >> 6];
+        base64_pairs[i][1] = base64_alphabet[i & 0x3f];
     }
-    if(flags & GSS_C_INTEG_FLAG) {
-        res = xcons(env, env->intern(env, ":integ"), res);
+    for(int i = 0 ; i < 256 ; i++) {
+        base64_decode_table[i] = BASE64_INVALID;
     }
-    if(flags & GSS_C_ANON_FLAG) {
-        res = xcons(env, env->intern(env, ":anon"), res);
+    for(int i = 0 ; i < 64 ; i++) {
+        base64_decode_table[(unsigned char)base64_alphabet[i]] = i;
     }
-    if(flags & GSS_C_PROT_READY_FLAG) {
-        res = xcons(env, env->intern(env, ":prot-ready"), res);
+}
+
+static size_t base64_encoded_length(size_t length)
+{
+    return (length + 2) / 3 * 4;
+}
+
+static void base64_encode(const unsigned char *in, size_t length, char *out)
+{
+    size_t i = 0;
+    for(; i + 3 <= length ; i += 3) {
+        uint32_t v = ((uint32_t)in[i] << 16) | ((uint32_t)in[i + 1] << 8) | in[i + 2];
+        memcpy(out, base64_pairs[v >> 12], 2);
+        memcpy(out + 2, base64_pairs[v & 0xfff], 2);
+        out += 4;
     }
-    if(flags & GSS_C_TRANS_FLAG) {
-        res = xcons(env, env->intern(env, ":trans"), res);
+    if(i < length) {
+        uint32_t v = (uint32_t)in[i] << 16;
+        if(i + 1 < length) {
+            v |= (uint32_t)in[i + 1] << 8;
+        }
+        memcpy(out, base64_pairs[v >> 12], 2);
+        out[2] = i + 1 < length ? base64_pairs[v & 0xfff][0] : '=';
+        out[3] = '=';
     }
-    return res;
 }
 
-static gss_ctx_id_t make_context_ref(emacs_env *env, emacs_value context)
+// Decodes LENGTH characters of IN into OUT, which must have room for
+// LENGTH / 4 * 3 bytes. Returns the number of bytes written, or -1 if
+// the input is not valid base64.
+static ptrdiff_t base64_decode(const char *in, size_t length, unsigned char *out)
 {
-    if(env->is_not_nil(env, context)) {
-        ContextWrapper *w = env->get_user_ptr(env, context);
-        return w->context;
+    if(length % 4 != 0) {
+        return -1;
     }
-    else {
-        return GSS_C_NO_CONTEXT;
+    size_t padding = 0;
+    if(length > 0 && in[length - 1] == '=') {
+        padding = in[length - 2] == '=' ? 2 : 1;
+    }
+
+    unsigned char *start = out;
+    const unsigned char *p = (const unsigned char *)in;
+    const unsigned char *end = p + length - (padding > 0 ? 4 : 0);
+    for(; p < end ; p += 4) {
+        uint32_t v = (base64_decode_table[p[0]] << 18) | (base64_decode_table[p[1]] << 12)
+            | (base64_decode_table[p[2]] << 6) | base64_decode_table[p[3]];
+        // The invalid marker survives the shifts above
+        if((base64_decode_table[p[0]] | base64_decode_table[p[1]]
+            | base64_decode_table[p[2]] | base64_decode_table[p[3]]) & BASE64_INVALID) {
+            return -1;
+        }
+        out[0] = v >> 16;
+        out[1] = v >> 8;
+        out[2] = v;
+        out += 3;
+    }
+    if(padding > 0) {
+        uint32_t a = base64_decode_table[p[0]];
+        uint32_t b = base64_decode_table[p[1]];
+        uint32_t c = padding == 1 ? base64_decode_table[p[2]] : 0;
+        if((a | b | c) & BASE64_INVALID) {
+            return -1;
+        }
+        uint32_t v = (a << 18) | (b << 12) | (c << 6);
+        *out++ = v >> 16;
+        if(padding == 1) {
+            *out++ = v >> 8;
+        }
     }
+    return out - start;
 }
 
-static gss_buffer_desc make_input_token(emacs_env *env, emacs_value content)
+// Stores the bytes of the multibyte STRING at offset LENGTH of BUF.
+// copy_string_contents encodes a multibyte string as UTF-8 and rejects
+// raw bytes, so the string is passed through base64-encode-string,
+// which is exact for raw bytes, and the result is decoded in place. Any
+// other non-ASCII character has no byte value, and is rejected rather
+// than silently encoded. Returns 0 after signalling an error.
+static int copy_multibyte_string_bytes(emacs_env *env, emacs_value string, unsigned char **buf, size_t *buf_size, size_t *length)
 {
-    gss_buffer_desc input_token;
-    if(env->is_not_nil(env, content)) {
-        size_t input_token_length = env->vec_size(env, content);
-        unsigned char *input_token_buf = malloc(input_token_length);
-        for(size_t i = 0 ; i < input_token_length ; i++) {
-            input_token_buf[i] = env->extract_integer(env, env->vec_get(env, content, i));
+    emacs_value encode_args[] = { string, Qt };
+    emacs_value text = env->funcall(env, Qbase64_encode_string, 2, encode_args);
+    if(env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+        // A quit is passed on unchanged
+        emacs_value symbol;
+        emacs_value exit_data;
+        if(env->non_local_exit_get(env, &symbol, &exit_data) == emacs_funcall_exit_signal && env->eq(env, symbol, Qerror)) {
+            env->non_local_exit_clear(env);
+            throw_error(env, "string contains characters which are not bytes, encode it first");
         }
-        input_token.value = input_token_buf;
-        input_token.length = input_token_length;
+        return 0;
     }
-    else {
-        input_token.value = NULL;
-        input_token.length = 0;
+
+    ptrdiff_t size;
+    if(!env->copy_string_contents(env, text, NULL, &size)) {
+        return 0;
+    }
+    if(!grow_buffer(buf, buf_size, *length, *length + size)) {
+        throw_error(env, "out of memory");
+        return 0;
+    }
+    unsigned char *p = *buf + *length;
+    if(!env->copy_string_contents(env, text, (char *)p, &size)) {
+        return 0;
     }
 
-    return input_token;
+    // The size includes the terminating NUL. The decoder never writes
+    // past the characters it has read.
+    ptrdiff_t decoded = base64_decode((char *)p, size - 1, p);
+    if(decoded < 0) {
+        throw_error(env, "invalid output from base64-encode-string");
+        return 0;
+    }
+    *length += decoded;
+    return 1;
 }
 
-static void free_input_token(gss_buffer_desc *token)
+// Clears the signal left by a failed copy_string_contents so that the
+// copy can be done another way. A quit is left pending. Returns 0 if
+// nothing was cleared.
+static int clear_copy_error(emacs_env *env)
 {
-    if(token->value != NULL) {
-        free(token->value);
+    emacs_value symbol;
+    emacs_value exit_data;
+    if(env->non_local_exit_get(env, &symbol, &exit_data) != emacs_funcall_exit_signal || env->eq(env, symbol, Qquit)) {
+        return 0;
     }
+    env->non_local_exit_clear(env);
+    return 1;
 }
 
-static emacs_value Fgssapi_internal_init_sec_context(emacs_env *env, ptrdiff_t nargs, emacs_value *args, void *data)
+// Appends the bytes of STRING to BUF, which holds LENGTH bytes and is
+// grown as needed. The string is copied once with copy_string_contents,
+// which is exact for unibyte strings and for ASCII. Only a multibyte
+// string with other characters takes the slower path above.
+// Returns 0 after signalling an error.
+static int copy_string_bytes(emacs_env *env, emacs_value string, unsigned char **buf, size_t *buf_size, size_t *length)
 {
-    (void)data;
-    (void)nargs;
-
-    emacs_value target = args[0];
-    emacs_value flags = args[1];
-    emacs_value context = args[2];
-    emacs_value time_req = args[3];
-    emacs_value content = args[4];
-
-    gss_ctx_id_t context_handle = make_context_ref(env, context);
-    gss_buffer_desc input_token = make_input_token(env, content);
-    gss_OID actual_mech_type;
-    gss_buffer_desc output_token;
-    OM_uint32 ret_flags;
-    OM_uint32 time_rec;
-
-    OM_uint32 minor;
-    OM_uint32 result = gss_init_sec_context(&minor, NULL, &context_handle, env->get_user_ptr(env, target),
-                                            GSS_C_NO_OID, make_flags(env, flags),
-                                            env->extract_integer(env, time_req), GSS_C_NO_CHANNEL_BINDINGS,
-                                            &input_token, &actual_mech_type, &output_token, &ret_flags, &time_rec);
-    free_input_token(&input_token);
-    if(GSS_ERROR(result)) {
-        if(env->is_not_nil(env, context)) {
-            ContextWrapper *context_wrapper = env->get_user_ptr(env, context);
-            context_wrapper->is_released = 1;
-        }
-        check_error(env, result, minor);
-        return env->intern(env, "nil");
+    ptrdiff_t size;
+    if(!env->copy_string_contents(env, string, NULL, &size)) {
+        // Raw bytes in a multibyte string are rejected by the UTF-8
+        // encoder
+        return clear_copy_error(env) && copy_multibyte_string_bytes(env, string, buf, buf_size, length);
     }
-
-    emacs_value Qnil = env->intern(env, "nil");
-    emacs_value Qt = env->intern(env, "t");
-    emacs_value context_ret;
-    if(context_handle == NULL) {
-        context_ret = Qnil;
+    if(!grow_buffer(buf, buf_size, *length, *length + size)) {
+        throw_error(env, "out of memory");
+        return 0;
     }
-    else if(env->is_not_nil(env, context)) {
-        context_ret = context;
+    unsigned char *p = *buf + *length;
+    if(!env->copy_string_contents(env, string, (char *)p, &size)) {
+        return 0;
     }
-    else {
-        ContextWrapper *context_wrapper = malloc(sizeof(ContextWrapper));
-        context_wrapper->context = context_handle;
-        context_wrapper->is_released = 0;
-        context_ret = env->make_user_ptr(env, free_context, context_wrapper);
+
+    // The size includes the terminating NUL
+    size_t n = size - 1;
+    size_t i = 0;
+    while(i < n && p[i] < 0x80) {
+        i++;
     }
+    if(i < n) {
+        emacs_value multibyte = env->funcall(env, Qmultibyte_string_p, 1, &string);
+        if(env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+            return 0;
+        }
+        if(env->is_not_nil(env, multibyte)) {
+            return copy_multibyte_string_bytes(env, string, buf, buf_size, length);
+        }
+    }
+    *length += n;
+    return 1;
+}
 
-    emacs_value result_list[] = { result & GSS_S_CONTINUE_NEEDED ? Qt : Qnil,
-                                  context_ret,
-                                  output_token.length == 0 ? Qnil : make_array(env, output_token.value, output_token.length),
-                                  parse_flags(env, ret_flags) };
+typedef struct {
+    unsigned char *buf;
+    size_t size;
+} ScratchBuffer;
 
-    result = gss_release_buffer(&minor, &output_token);
-    if(check_error(env, result, minor)) {
-        return Qnil;
+static int reserve_scratch_buffer(ScratchBuffer *scratch, size_t size)
+{
+    if(size <= scratch->size) {
+        return 1;
     }
-
-    return env->funcall(env, env->intern(env, "list"), 4, result_list);
+    // The old content doesn't need to be preserved
+    unsigned char *buf = pool_alloc(size);
+    if(buf == NULL) {
+        return 0;
+    }
+    pool_free(scratch->buf);
+    scratch->buf = buf;
+    scratch->size = size;
+    return 1;
 }
 
-static emacs_value Fgssapi_internal_accept_sec_context(emacs_env *env, ptrdiff_t nargs, emacs_value *args, void *data)
+// Copies the content of a token into the scratch buffer, growing it as
+// needed. The resulting token points into the scratch buffer, so it is
+// only valid until the next call that uses the same buffer.
+static int fill_input_token(emacs_env *env, emacs_value content, ScratchBuffer *scratch, gss_buffer_desc *input_token)
 {
-    (void)data;
-    (void)nargs;
+    input_token->value = NULL;
+    input_token->length = 0;
 
-    emacs_value content = args[0];
-    emacs_value context = args[1];
+    if(!env->is_not_nil(env, content)) {
+        return 1;
+    }
 
+    if(env->eq(env, env->type_of(env, content), Qstring)) {
+        size_t length = 0;
+        if(!copy_string_bytes(env, content, &scratch->buf, &scratch->size, &length)) {
+            return 0;
+        }
+        input_token->value = scratch->buf;
+        input_token->length = length;
+    }
+    else {
+        // Legacy format: a vector of integers, one per byte
+        size_t input_token_length = env->vec_size(env, content);
+        if(!reserve_scratch_buffer(scratch, input_token_length)) {
+            throw_error(env, "out of memory");
+            return 0;
+        }
+        unsigned char *input_token_buf = scratch->buf;
+        for(size_t i = 0 ; i < input_token_length ; i++) {
+            input_token_buf[i] = env->extract_integer(env, env->vec_get(env, content, i));
+        }
+        if(env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+            return 0;
+        }
+        input_token->value = input_token_buf;
+        input_token->length = input_token_length;
+    }
+
+    return 1;
+}
+
+// Copies the content of a token into a buffer of its own, which must
+// be released with free_input_token. Returns 0 after signalling an
+// error, in which case the token is empty.
+static int make_input_token(emacs_env *env, emacs_value content, gss_buffer_desc *input_token)
+{
+    ScratchBuffer scratch = { NULL, 0 };
+    if(!fill_input_token(env, content, &scratch, input_token)) {
+        pool_free(scratch.buf);
+        input_token->value = NULL;
+        input_token->length = 0;
+        return 0;
+    }
+    return 1;
+}
+
+static void free_input_token(gss_buffer_desc *token)
+{
+    pool_free(token->value);
+    token->value = NULL;
+}
+
+// Credentials are refreshed this many seconds before they expire
+#define DEFAULT_CRED_REFRESH_MARGIN 60
+
+static int use_default_cred_cache = 0;
+static gss_cred_id_t default_cred = GSS_C_NO_CREDENTIAL;
+// Zero if the credential never expires
+static time_t default_cred_expiry = 0;
+
+static void clear_default_cred(void)
+{
+    if(default_cred != GSS_C_NO_CREDENTIAL) {
+        if(!defer_release(default_cred)) {
+            OM_uint32 minor;
+            gss_release_cred(&minor, &default_cred);
+        }
+        default_cred = GSS_C_NO_CREDENTIAL;
+    }
+}
+
+// Returns the cached default initiator credential, acquiring it again
+// if it is missing or about to expire. If the credential can't be
+// acquired, GSS_C_NO_CREDENTIAL is returned and the error is reported
+// by gss_init_sec_context instead.
+static gss_cred_id_t get_default_cred(void)
+{
+    if(!use_default_cred_cache) {
+        return GSS_C_NO_CREDENTIAL;
+    }
+
+    time_t now = time(NULL);
+    if(default_cred != GSS_C_NO_CREDENTIAL && (default_cred_expiry == 0 || now < default_cred_expiry)) {
+        return default_cred;
+    }
+
+    clear_default_cred();
+
+    OM_uint32 time_rec;
+    OM_uint32 minor;
+    STATS_GSS_BEGIN();
+    OM_uint32 result = gss_acquire_cred(&minor, GSS_C_NO_NAME, GSS_C_INDEFINITE, GSS_C_NO_OID_SET, GSS_C_INITIATE,
+                                        &default_cred, NULL, &time_rec);
+    STATS_GSS_END();
+    if(GSS_ERROR(result)) {
+        default_cred = GSS_C_NO_CREDENTIAL;
+        return GSS_C_NO_CREDENTIAL;
+    }
+
+    if(time_rec == GSS_C_INDEFINITE) {
+        default_cred_expiry = 0;
+    }
+    else {
+        // A short-lived credential is kept for half of its lifetime, so
+        // that it isn't acquired again on every call
+        OM_uint32 margin = time_rec / 2 < DEFAULT_CRED_REFRESH_MARGIN ? time_rec / 2 : DEFAULT_CRED_REFRESH_MARGIN;
+        default_cred_expiry = now + time_rec - margin;
+    }
+
+    return default_cred;
+}
+
+// Returns the handle of the credential CRED. If CRED is nil, the cached
+// default credential is returned for an initiator and
+// GSS_C_NO_CREDENTIAL for an acceptor. A released credential signals
+// an error instead of silently falling back to the default.
+static gss_cred_id_t make_cred_ref(emacs_env *env, emacs_value cred, int initiator)
+{
+    if(!env->is_not_nil(env, cred)) {
+        return initiator ? get_default_cred() : GSS_C_NO_CREDENTIAL;
+    }
+    gss_cred_id_t cred_handle = env->get_user_ptr(env, cred);
+    if(cred_handle == GSS_C_NO_CREDENTIAL) {
+        throw_error(env, "credential has been released");
+    }
+    return cred_handle;
+}
+
+#define NEGOTIATE_PREFIX "Negotiate "
+#define NEGOTIATE_PREFIX_LENGTH (sizeof(NEGOTIATE_PREFIX) - 1)
+
+// DER encoding of 1.3.6.1.5.5.2
+static gss_OID_desc spnego_mech = { 6, "\x2b\x06\x01\x05\x05\x02" };
+
+// Returns the header value "Negotiate <base64>" for TOKEN.
+static emacs_value make_negotiate_header(emacs_env *env, const gss_buffer_desc *token)
+{
+    size_t length = NEGOTIATE_PREFIX_LENGTH + base64_encoded_length(token->length);
+    char *buf = pool_alloc(length);
+    if(buf == NULL) {
+        throw_error(env, "out of memory");
+        return Qnil;
+    }
+    memcpy(buf, NEGOTIATE_PREFIX, NEGOTIATE_PREFIX_LENGTH);
+    base64_encode(token->value, token->length, buf + NEGOTIATE_PREFIX_LENGTH);
+    emacs_value ret = env->make_string(env, buf, length);
+    pool_free(buf);
+    return ret;
+}
+
+// Parses a header value of the form "Negotiate <base64>" into TOKEN. A
+// nil header or a header without data gives an empty token. Returns 0
+// and signals an error if the header can't be parsed.
+static int parse_negotiate_header(emacs_env *env, emacs_value header, gss_buffer_desc *token)
+{
+    token->length = 0;
+    token->value = NULL;
+    if(!env->is_not_nil(env, header)) {
+        return 1;
+    }
+
+    char *buf = copy_string(env, header);
+    if(buf == NULL) {
+        return 0;
+    }
+
+    size_t length = strlen(buf);
+    size_t start = 0;
+    while(start < length && (buf[start] == ' ' || buf[start] == '\t')) {
+        start++;
+    }
+    if(length - start < NEGOTIATE_PREFIX_LENGTH - 1
+       || strncasecmp(buf + start, NEGOTIATE_PREFIX, NEGOTIATE_PREFIX_LENGTH - 1) != 0) {
+        pool_free(buf);
+        throw_error(env, "not a Negotiate header");
+        return 0;
+    }
+    start += NEGOTIATE_PREFIX_LENGTH - 1;
+    while(start < length && (buf[start] == ' ' || buf[start] == '\t')) {
+        start++;
+    }
+    while(length > start && (buf[length - 1] == ' ' || buf[length - 1] == '\t'
+                             || buf[length - 1] == '\r' || buf[length - 1] == '\n')) {
+        length--;
+    }
+    if(start == length) {
+        pool_free(buf);
+        return 1;
+    }
+
+    // Decoding in place is safe since the output is shorter than the input
+    unsigned char *out = (unsigned char *)buf;
+    ptrdiff_t decoded = base64_decode(buf + start, length - start, out);
+    if(decoded < 0) {
+        pool_free(buf);
+        throw_error(env, "invalid base64 data in Negotiate header");
+        return 0;
+    }
+    token->length = decoded;
+    token->value = buf;
+    return 1;
+}
+
+// Returns the output token of a context establishment call, either as
+// a string of bytes or as a Negotiate header value.
+static emacs_value make_output_token(emacs_env *env, const gss_buffer_desc *output_token, int negotiate)
+{
+    if(output_token->length == 0) {
+        return Qnil;
+    }
+    return negotiate ? make_negotiate_header(env, output_token) : make_bytes(env, output_token->value, output_token->length);
+}
+
+// Builds the return value of gss--internal-init-sec-context from the
+// output of a successful call to gss_init_sec_context, and releases the
+// output token. The result is (CONTINUE-NEEDED CONTEXT TOKEN FLAGS
+// TIME-REC), where TIME-REC is nil if the context does not expire.
+static emacs_value make_init_sec_context_result(emacs_env *env, OM_uint32 result, emacs_value context,
+                                                gss_ctx_id_t context_handle, gss_buffer_desc *output_token,
+                                                OM_uint32 ret_flags, OM_uint32 time_rec, int negotiate)
+{
+    emacs_value context_ret;
+    if(context_handle == NULL) {
+        context_ret = Qnil;
+    }
+    else if(env->is_not_nil(env, context)) {
+        context_ret = context;
+    }
+    else {
+        context_ret = make_context_ptr(env, context_handle);
+    }
+
+    emacs_value result_list[] = { result & GSS_S_CONTINUE_NEEDED ? Qt : Qnil,
+                                  context_ret,
+                                  make_output_token(env, output_token, negotiate),
+                                  env->make_integer(env, ret_flags),
+                                  time_rec == GSS_C_INDEFINITE ? Qnil : env->make_integer(env, time_rec) };
+
+    OM_uint32 minor;
+    result = gss_release_buffer(&minor, output_token);
+    if(check_error(env, result, minor)) {
+        return Qnil;
+    }
+
+    return env->funcall(env, Qlist, 5, result_list);
+}
+
+// Runs gss_init_sec_context for MECH and releases INPUT_TOKEN. When
+// NEGOTIATE is non-zero the output token is returned as a Negotiate
+// header value.
+static emacs_value init_sec_context(emacs_env *env, emacs_value target, emacs_value flags, emacs_value context,
+                                    emacs_value time_req, gss_buffer_desc input_token, emacs_value cred,
+                                    gss_OID mech, int negotiate)
+{
+    gss_cred_id_t cred_handle = make_cred_ref(env, cred, 1);
     gss_ctx_id_t context_handle = make_context_ref(env, context);
-    gss_buffer_desc input_token = make_input_token(env, content);
-    gss_name_t src_name;
+    if(env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+        free_input_token(&input_token);
+        return Qnil;
+    }
+    gss_OID actual_mech_type = GSS_C_NO_OID;
     gss_buffer_desc output_token;
     OM_uint32 ret_flags;
     OM_uint32 time_rec;
-    gss_cred_id_t output_cred_handle;
 
     OM_uint32 minor;
-    OM_uint32 result = gss_accept_sec_context(&minor, &context_handle, NULL, &input_token, GSS_C_NO_CHANNEL_BINDINGS,
-                                              &src_name, NULL, &output_token, &ret_flags, &time_rec, &output_cred_handle);
+    STATS_GSS_BEGIN();
+    OM_uint32 result = gss_init_sec_context(&minor, cred_handle, &context_handle, env->get_user_ptr(env, target),
+                                            mech, make_flags(env, flags),
+                                            env->extract_integer(env, time_req), GSS_C_NO_CHANNEL_BINDINGS,
+                                            &input_token, &actual_mech_type, &output_token, &ret_flags, &time_rec);
+    STATS_GSS_END();
+    TRACE_TOKENS(TRACE_INIT, !env->is_not_nil(env, context), result, context_handle,
+                 &input_token, GSS_ERROR(result) ? NULL : &output_token);
     free_input_token(&input_token);
-    if(check_error(env, result, minor)) {
-        return env->intern(env, "nil");
+    if(GSS_ERROR(result)) {
+        if(env->is_not_nil(env, context)) {
+            mark_context_released(env->get_user_ptr(env, context));
+        }
+        check_error_mech(env, result, minor, actual_mech_type);
+        return Qnil;
+    }
+
+    STATS_BYTES(input_token.length, output_token.length);
+    return make_init_sec_context_result(env, result, context, context_handle, &output_token, ret_flags, time_rec, negotiate);
+}
+
+static emacs_value Fgssapi_internal_init_sec_context(emacs_env *env, ptrdiff_t nargs, emacs_value *args, void *data)
+{
+    (void)data;
+
+    emacs_value cred = nargs > 5 ? args[5] : Qnil;
+    gss_buffer_desc input_token;
+    if(!make_input_token(env, args[4], &input_token)) {
+        return Qnil;
+    }
+    return init_sec_context(env, args[0], args[1], args[2], args[3], input_token, cred, GSS_C_NO_OID, 0);
+}
+
+// Like gss--internal-init-sec-context, but uses SPNEGO, and takes and
+// returns tokens as HTTP Negotiate header values.
+static emacs_value Fnegotiate_header(emacs_env *env, ptrdiff_t nargs, emacs_value *args, void *data)
+{
+    (void)data;
+
+    emacs_value cred = nargs > 5 ? args[5] : Qnil;
+    gss_buffer_desc input_token;
+    if(!parse_negotiate_header(env, args[4], &input_token)) {
+        return Qnil;
+    }
+    return init_sec_context(env, args[0], args[1], args[2], args[3], input_token, cred, &spnego_mech, 1);
+}
+
+// Runs gss_accept_sec_context and releases INPUT_TOKEN. CRED is an
+// acceptor credential, or nil to use the default keytab. When NEGOTIATE
+// is non-zero the output token is returned as a Negotiate header value.
+static emacs_value accept_sec_context(emacs_env *env, emacs_value context, gss_buffer_desc input_token,
+                                      emacs_value cred, int negotiate)
+{
+    gss_cred_id_t cred_handle = make_cred_ref(env, cred, 0);
+    gss_ctx_id_t context_handle = make_context_ref(env, context);
+    if(env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+        free_input_token(&input_token);
+        return Qnil;
+    }
+    gss_name_t src_name = GSS_C_NO_NAME;
+    gss_OID mech_type = GSS_C_NO_OID;
+    gss_buffer_desc output_token;
+    OM_uint32 ret_flags;
+    OM_uint32 time_rec;
+    gss_cred_id_t output_cred_handle = GSS_C_NO_CREDENTIAL;
+
+    OM_uint32 minor;
+    STATS_GSS_BEGIN();
+    OM_uint32 result = gss_accept_sec_context(&minor, &context_handle, cred_handle, &input_token, GSS_C_NO_CHANNEL_BINDINGS,
+                                              &src_name, &mech_type, &output_token, &ret_flags, &time_rec, &output_cred_handle);
+    STATS_GSS_END();
+    TRACE_TOKENS(TRACE_ACCEPT, !env->is_not_nil(env, context), result, context_handle,
+                 &input_token, GSS_ERROR(result) ? NULL : &output_token);
+    free_input_token(&input_token);
+    if(output_cred_handle != GSS_C_NO_CREDENTIAL) {
+        OM_uint32 cred_minor;
+        gss_release_cred(&cred_minor, &output_cred_handle);
+    }
+    if(GSS_ERROR(result)) {
+        if(env->is_not_nil(env, context)) {
+            mark_context_released(env->get_user_ptr(env, context));
+        }
+        check_error_mech(env, result, minor, mech_type);
+        return Qnil;
+    }
+
+    emacs_value context_ret;
+    if(context_handle == GSS_C_NO_CONTEXT) {
+        context_ret = Qnil;
+    }
+    else if(env->is_not_nil(env, context)) {
+        context_ret = context;
+    }
+    else {
+        context_ret = make_context_ptr(env, context_handle);
     }
 
-    emacs_value Qnil = env->intern(env, "nil");
-    emacs_value Qt = env->intern(env, "t");
+    STATS_BYTES(input_token.length, output_token.length);
     emacs_value result_list[] = { result & GSS_S_CONTINUE_NEEDED ? Qt : Qnil,
-                                  context_handle == NULL ? Qnil : env->make_user_ptr(env, free_context, context_handle),
-                                  env->make_user_ptr(env, release_name, src_name),
-                                  output_token.length == 0 ? Qnil : make_array(env, output_token.value, output_token.length),
-                                  parse_flags(env, ret_flags),
+                                  context_ret,
+                                  make_name_ptr(env, src_name),
+                                  make_output_token(env, &output_token, negotiate),
+                                  env->make_integer(env, ret_flags),
                                   env->make_integer(env, time_rec),
                                   Qnil };
 
     result = gss_release_buffer(&minor, &output_token);
     if(check_error(env, result, minor)) {
-        return env->intern(env, "nil");
+        return Qnil;
+    }
+
+    return env->funcall(env, Qlist, 7, result_list);
+}
+
+static emacs_value Fgssapi_internal_accept_sec_context(emacs_env *env, ptrdiff_t nargs, emacs_value *args, void *data)
+{
+    (void)data;
+
+    emacs_value cred = nargs > 2 ? args[2] : Qnil;
+    gss_buffer_desc input_token;
+    if(!make_input_token(env, args[0], &input_token)) {
+        return Qnil;
     }
+    return accept_sec_context(env, args[1], input_token, cred, 0);
+}
+
+// Like gss--internal-accept-sec-context, but takes the value of an
+// Authorization header and returns the value of the WWW-Authenticate
+// header to send back, if any.
+static emacs_value Fnegotiate_accept_header(emacs_env *env, ptrdiff_t nargs, emacs_value *args, void *data)
+{
+    (void)data;
 
-    return env->funcall(env, env->intern(env, "list"), 7, result_list);
+    emacs_value cred = nargs > 2 ? args[2] : Qnil;
+    gss_buffer_desc input_token;
+    if(!parse_negotiate_header(env, args[0], &input_token)) {
+        return Qnil;
+    }
+    return accept_sec_context(env, args[1], input_token, cred, 1);
 }
 
 static emacs_value Fregister_acceptor_identity(emacs_env *env, ptrdiff_t nargs, emacs_value *args, void *data)
@@ -510,21 +2090,18 @@ static emacs_value Fregister_acceptor_identity(emacs_env *env, ptrdiff_t nargs,
 
     emacs_value filename = args[0];
 
-    ptrdiff_t size;
-    env->copy_string_contents(env, filename, NULL, &size);
-    char *buf = malloc(size);
-    if(!env->copy_string_contents(env, filename, buf, &size)) {
-        throw_error(env, "unable to copy string");
-        return env->intern(env, "nil");
+    char *buf = copy_string(env, filename);
+    if(buf == NULL) {
+        return Qnil;
     }
-    
+
     OM_uint32 result = gsskrb5_register_acceptor_identity(buf);
-    free(buf);
+    pool_free(buf);
     if(GSS_ERROR(result)) {
         throw_error(env, "Error loading file");
     }
 
-    return env->intern(env, "nil");
+    return Qnil;
 }
 
 static emacs_value Fwrap(emacs_env *env, ptrdiff_t nargs, emacs_value *args, void *data)
@@ -536,98 +2113,2775 @@ static emacs_value Fwrap(emacs_env *env, ptrdiff_t nargs, emacs_value *args, voi
     emacs_value buffer = args[1];
     emacs_value conf = args[2];
 
-    ContextWrapper *context_wrapper = env->get_user_ptr(env, context);
-    gss_buffer_desc buffer_desc = make_input_token(env, buffer);
+    gss_ctx_id_t context_handle = make_context_ref(env, context);
+    if(env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+        return Qnil;
+    }
+    gss_buffer_desc buffer_desc;
+    if(!make_input_token(env, buffer, &buffer_desc)) {
+        return Qnil;
+    }
     int conf_state;
     gss_buffer_desc output_desc;
 
     OM_uint32 minor;
+    STATS_GSS_BEGIN();
     OM_uint32 result = gss_wrap(&minor,
-                                context_wrapper->context,
+                                context_handle,
                                 env->is_not_nil(env, conf) ? 1 : 0,
                                 GSS_C_QOP_DEFAULT,
                                 &buffer_desc,
                                 &conf_state,
                                 &output_desc);
+    STATS_GSS_END();
     free_input_token(&buffer_desc);
+    TRACE_SIZES(TRACE_WRAP, env->is_not_nil(env, conf), result, context_handle,
+                buffer_desc.length, GSS_ERROR(result) ? 0 : output_desc.length);
     if(check_error(env, result, minor)) {
-        return env->intern(env, "nil");
+        return Qnil;
     }
 
-    emacs_value ret = make_array(env, output_desc.value, output_desc.length);
+    STATS_BYTES(buffer_desc.length, output_desc.length);
+    emacs_value ret = make_bytes(env, output_desc.value, output_desc.length);
 
     result = gss_release_buffer(&minor, &output_desc);
     if(check_error(env, result, minor)) {
-        return env->intern(env, "nil");
+        return Qnil;
     }
 
-    emacs_value Qlist = env->intern(env, "list");
-    emacs_value result_list[] = { ret, conf_state ? env->intern(env, "t") : env->intern(env, "nil") };
+    emacs_value result_list[] = { ret, conf_state ? Qt : Qnil };
     return env->funcall(env, Qlist, 2, result_list);
 }
 
+// Maps the routine error of a per-message call to a keyword. Only the
+// errors that can be caused by the peer or by the state of the context
+// have their own keyword.
+static emacs_value make_message_status(OM_uint32 result)
+{
+    switch(GSS_ROUTINE_ERROR(result)) {
+    case 0:
+        return Qok;
+    case GSS_S_BAD_SIG:
+        return Qbad_sig;
+    case GSS_S_DEFECTIVE_TOKEN:
+        return Qdefective_token;
+    case GSS_S_NO_CONTEXT:
+        return Qno_context;
+    case GSS_S_CONTEXT_EXPIRED:
+        return Qcontext_expired;
+    case GSS_S_BAD_QOP:
+        return Qbad_qop;
+    default:
+        return Qfailure;
+    }
+}
+
+// Returns the supplementary status bits of RESULT as a list of
+// keywords. The common case of no supplementary information does not
+// allocate.
+static emacs_value make_supplementary_list(emacs_env *env, OM_uint32 result)
+{
+    emacs_value ret = Qnil;
+    if(result & GSS_S_GAP_TOKEN) {
+        ret = xcons(env, Qgap_token, ret);
+    }
+    if(result & GSS_S_UNSEQ_TOKEN) {
+        ret = xcons(env, Qunseq_token, ret);
+    }
+    if(result & GSS_S_OLD_TOKEN) {
+        ret = xcons(env, Qold_token, ret);
+    }
+    if(result & GSS_S_DUPLICATE_TOKEN) {
+        ret = xcons(env, Qduplicate_token, ret);
+    }
+    return ret;
+}
+
+// When the optional third argument is non-nil, errors are not
+// signalled. The result is then (STATUS DATA CONF SUPPLEMENTARY), where
+// STATUS is :ok or a keyword describing the error, DATA is nil unless
+// STATUS is :ok, and SUPPLEMENTARY is a list of keywords.
 static emacs_value Funwrap(emacs_env *env, ptrdiff_t nargs, emacs_value *args, void *data)
 {
     (void)data;
-    (void)nargs;
     
     emacs_value context = args[0];
     emacs_value buffer = args[1];
+    int noerror = nargs > 2 && env->is_not_nil(env, args[2]);
 
-    ContextWrapper *context_wrapper = env->get_user_ptr(env, context);
-    gss_buffer_desc buffer_desc = make_input_token(env, buffer);
+    gss_ctx_id_t context_handle = make_context_ref(env, context);
+    if(env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+        return Qnil;
+    }
+    gss_buffer_desc buffer_desc;
+    if(!make_input_token(env, buffer, &buffer_desc)) {
+        return Qnil;
+    }
     int conf_state;
     gss_qop_t qop_state;
     gss_buffer_desc output_desc;
 
     OM_uint32 minor;
+    STATS_GSS_BEGIN();
     OM_uint32 result = gss_unwrap(&minor,
-                                  context_wrapper->context,
+                                  context_handle,
                                   &buffer_desc,
                                   &output_desc,
                                   &conf_state,
                                   &qop_state);
+    STATS_GSS_END();
     free_input_token(&buffer_desc);
+    TRACE_SIZES(TRACE_UNWRAP, !GSS_ERROR(result) && conf_state, result, context_handle,
+                buffer_desc.length, GSS_ERROR(result) ? 0 : output_desc.length);
+    if(noerror && GSS_ERROR(result)) {
+        emacs_value result_list[] = { make_message_status(result), Qnil, Qnil, make_supplementary_list(env, result) };
+        return env->funcall(env, Qlist, 4, result_list);
+    }
     if(check_error(env, result, minor)) {
-        return env->intern(env, "nil");
+        return Qnil;
     }
 
-    emacs_value ret = make_array(env, output_desc.value, output_desc.length);
+    STATS_BYTES(buffer_desc.length, output_desc.length);
+    emacs_value ret = make_bytes(env, output_desc.value, output_desc.length);
 
-    result = gss_release_buffer(&minor, &output_desc);
-    if(check_error(env, result, minor)) {
-        return env->intern(env, "nil");
+    OM_uint32 release_result = gss_release_buffer(&minor, &output_desc);
+    if(check_error(env, release_result, minor)) {
+        return Qnil;
     }
 
-    emacs_value Qlist = env->intern(env, "list");
-    emacs_value result_list[] = { ret, conf_state ? env->intern(env, "t") : env->intern(env, "nil") };
+    if(noerror) {
+        emacs_value result_list[] = { Qok, ret, conf_state ? Qt : Qnil, make_supplementary_list(env, result) };
+        return env->funcall(env, Qlist, 4, result_list);
+    }
+    emacs_value result_list[] = { ret, conf_state ? Qt : Qnil };
     return env->funcall(env, Qlist, 2, result_list);
 }
 
-int emacs_module_init(struct emacs_runtime *ert)
+// Wraps a string using gss_wrap_iov. The payload is copied straight
+// into the DATA part of a single output buffer laid out as
+// HEADER|DATA|PADDING|TRAILER, which is then encrypted in place.
+static emacs_value Fwrap_iov(emacs_env *env, ptrdiff_t nargs, emacs_value *args, void *data)
 {
-    emacs_env *env = ert->get_environment(ert);
+    (void)data;
+    (void)nargs;
 
-    emacs_value make_name_fn = env->make_function(env, 2, 2, Fgssapi_internal_import_name, "integrate gss_import_name", NULL);
-    bind_function(env, "gss--internal-import-name", make_name_fn);
+    emacs_value context = args[0];
+    emacs_value buffer = args[1];
+    emacs_value conf = args[2];
 
-    emacs_value name_to_string_fn = env->make_function(env, 1, 1, Fgssapi_internal_name_to_string, "integrate gss_display_name", NULL);
-    bind_function(env, "gss--internal-name-to-string", name_to_string_fn);
+    gss_ctx_id_t context_handle = make_context_ref(env, context);
+    if(env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+        return Qnil;
+    }
+    int conf_req = env->is_not_nil(env, conf) ? 1 : 0;
 
-    emacs_value init_sec_context_fn = env->make_function(env, 5, 5, Fgssapi_internal_init_sec_context, "integrate gss_init_sec_context", NULL);
-    bind_function(env, "gss--internal-init-sec-context", init_sec_context_fn);
+    // The UTF-8 size is the payload length unless the string holds raw
+    // bytes, and is only used to lay out the buffer before the copy
+    ptrdiff_t string_size;
+    if(!env->copy_string_contents(env, buffer, NULL, &string_size)) {
+        if(!clear_copy_error(env)) {
+            return Qnil;
+        }
+        string_size = 1;
+    }
+    size_t data_length = string_size - 1;
 
-    emacs_value accept_sec_context_fn = env->make_function(env, 2, 2, Fgssapi_internal_accept_sec_context, "integrate gss_accept_sec_context", NULL);
-    bind_function(env, "gss--internal-accept-sec-context", accept_sec_context_fn);
+    gss_iov_buffer_desc iov[4];
+    iov[0].type = GSS_IOV_BUFFER_TYPE_HEADER;
+    iov[1].type = GSS_IOV_BUFFER_TYPE_DATA;
+    iov[1].buffer.length = data_length;
+    iov[2].type = GSS_IOV_BUFFER_TYPE_PADDING;
+    iov[3].type = GSS_IOV_BUFFER_TYPE_TRAILER;
 
-    emacs_value register_acceptor_identity_fn = env->make_function(env, 1, 1, Fregister_acceptor_identity, "integrate krb5_gss_register_acceptor_identity", NULL);
-    bind_function(env, "gss--internal-krb5-register-acceptor-identity", register_acceptor_identity_fn);
+    int conf_state;
+    OM_uint32 minor;
+    STATS_GSS_BEGIN();
+    OM_uint32 result = gss_wrap_iov_length(&minor, context_handle, conf_req, GSS_C_QOP_DEFAULT, &conf_state, iov, 4);
+    STATS_GSS_END();
+    if(check_error(env, result, minor)) {
+        return Qnil;
+    }
 
-    emacs_value wrap_fn = env->make_function(env, 3, 3, Fwrap, "integrates gss_wrap", NULL);
-    bind_function(env, "gss--internal-wrap", wrap_fn);
+    // One extra byte for the NUL written by copy_string_contents
+    size_t header_length = iov[0].buffer.length;
+    unsigned char *output = NULL;
+    size_t output_size = 0;
+    if(!grow_buffer(&output, &output_size, 0,
+                    header_length + data_length + iov[2].buffer.length + iov[3].buffer.length + 1)) {
+        throw_error(env, "out of memory");
+        return Qnil;
+    }
+    size_t output_length = header_length;
+    if(!copy_string_bytes(env, buffer, &output, &output_size, &output_length)) {
+        pool_free(output);
+        return Qnil;
+    }
 
-    emacs_value unwrap_fn = env->make_function(env, 2, 2, Funwrap, "integrates gss_unwrap", NULL);
-    bind_function(env, "gss--internal-unwrap", unwrap_fn);
+    if(output_length - header_length != data_length) {
+        // The string held raw bytes, so the lengths are computed again
+        // for the real payload
+        data_length = output_length - header_length;
+        iov[1].buffer.length = data_length;
+        STATS_GSS_BEGIN();
+        result = gss_wrap_iov_length(&minor, context_handle, conf_req, GSS_C_QOP_DEFAULT, &conf_state, iov, 4);
+        STATS_GSS_END();
+        if(check_error(env, result, minor)) {
+            pool_free(output);
+            return Qnil;
+        }
+        if(!grow_buffer(&output, &output_size, header_length + data_length,
+                        iov[0].buffer.length + data_length + iov[2].buffer.length + iov[3].buffer.length)) {
+            pool_free(output);
+            throw_error(env, "out of memory");
+            return Qnil;
+        }
+        if(iov[0].buffer.length != header_length) {
+            memmove(output + iov[0].buffer.length, output + header_length, data_length);
+            header_length = iov[0].buffer.length;
+        }
+    }
+
+    size_t total_length = header_length + data_length + iov[2].buffer.length + iov[3].buffer.length;
+    unsigned char *p = output;
+    for(int i = 0 ; i < 4 ; i++) {
+        iov[i].buffer.value = p;
+        p += iov[i].buffer.length;
+    }
+
+    STATS_GSS_BEGIN();
+    result = gss_wrap_iov(&minor, context_handle, conf_req, GSS_C_QOP_DEFAULT, &conf_state, iov, 4);
+    STATS_GSS_END();
+    if(check_error(env, result, minor)) {
+        pool_free(output);
+        return Qnil;
+    }
+
+    STATS_BYTES(data_length, total_length);
+    emacs_value ret = make_bytes(env, output, total_length);
+    pool_free(output);
+
+    emacs_value result_list[] = { ret, conf_state ? Qt : Qnil };
+    return env->funcall(env, Qlist, 2, result_list);
+}
+
+// Unwraps a token using gss_unwrap_iov. The token is decrypted in place
+// and the resulting DATA buffer points into the input copy.
+static emacs_value Funwrap_iov(emacs_env *env, ptrdiff_t nargs, emacs_value *args, void *data)
+{
+    (void)data;
+    (void)nargs;
+
+    emacs_value context = args[0];
+    emacs_value buffer = args[1];
+
+    gss_ctx_id_t context_handle = make_context_ref(env, context);
+    if(env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+        return Qnil;
+    }
+    gss_buffer_desc buffer_desc;
+    if(!make_input_token(env, buffer, &buffer_desc)) {
+        return Qnil;
+    }
+
+    gss_iov_buffer_desc iov[2];
+    iov[0].type = GSS_IOV_BUFFER_TYPE_STREAM;
+    iov[0].buffer = buffer_desc;
+    iov[1].type = GSS_IOV_BUFFER_TYPE_DATA;
+    iov[1].buffer.value = NULL;
+    iov[1].buffer.length = 0;
+
+    int conf_state;
+    gss_qop_t qop_state;
+    OM_uint32 minor;
+    STATS_GSS_BEGIN();
+    OM_uint32 result = gss_unwrap_iov(&minor, context_handle, &conf_state, &qop_state, iov, 2);
+    STATS_GSS_END();
+    if(check_error(env, result, minor)) {
+        free_input_token(&buffer_desc);
+        return Qnil;
+    }
+
+    STATS_BYTES(buffer_desc.length, iov[1].buffer.length);
+    emacs_value ret = make_bytes(env, iov[1].buffer.value, iov[1].buffer.length);
+    free_input_token(&buffer_desc);
+
+    emacs_value result_list[] = { ret, conf_state ? Qt : Qnil };
+    return env->funcall(env, Qlist, 2, result_list);
+}
+
+static emacs_value Fget_mic(emacs_env *env, ptrdiff_t nargs, emacs_value *args, void *data)
+{
+    (void)data;
+    (void)nargs;
+
+    emacs_value context = args[0];
+    emacs_value buffer = args[1];
+
+    gss_ctx_id_t context_handle = make_context_ref(env, context);
+    if(env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+        return Qnil;
+    }
+    gss_buffer_desc buffer_desc;
+    if(!make_input_token(env, buffer, &buffer_desc)) {
+        return Qnil;
+    }
+    gss_buffer_desc mic_desc;
+
+    OM_uint32 minor;
+    STATS_GSS_BEGIN();
+    OM_uint32 result = gss_get_mic(&minor, context_handle, GSS_C_QOP_DEFAULT, &buffer_desc, &mic_desc);
+    STATS_GSS_END();
+    free_input_token(&buffer_desc);
+    if(check_error(env, result, minor)) {
+        return Qnil;
+    }
+
+    STATS_BYTES(buffer_desc.length, mic_desc.length);
+    emacs_value ret = make_bytes(env, mic_desc.value, mic_desc.length);
+
+    result = gss_release_buffer(&minor, &mic_desc);
+    if(check_error(env, result, minor)) {
+        return Qnil;
+    }
+
+    return ret;
+}
+
+// When the optional fourth argument is non-nil, errors are not
+// signalled and the result is (STATUS QOP SUPPLEMENTARY), as for
+// Funwrap.
+static emacs_value Fverify_mic(emacs_env *env, ptrdiff_t nargs, emacs_value *args, void *data)
+{
+    (void)data;
+
+    emacs_value context = args[0];
+    emacs_value buffer = args[1];
+    emacs_value mic = args[2];
+    int noerror = nargs > 3 && env->is_not_nil(env, args[3]);
+
+    gss_ctx_id_t context_handle = make_context_ref(env, context);
+    if(env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+        return Qnil;
+    }
+    gss_buffer_desc buffer_desc;
+    if(!make_input_token(env, buffer, &buffer_desc)) {
+        return Qnil;
+    }
+    gss_buffer_desc mic_desc;
+    if(!make_input_token(env, mic, &mic_desc)) {
+        free_input_token(&buffer_desc);
+        return Qnil;
+    }
+    gss_qop_t qop_state;
+
+    OM_uint32 minor;
+    STATS_GSS_BEGIN();
+    OM_uint32 result = gss_verify_mic(&minor, context_handle, &buffer_desc, &mic_desc, &qop_state);
+    STATS_GSS_END();
+    free_input_token(&buffer_desc);
+    free_input_token(&mic_desc);
+    if(noerror) {
+        STATS_BYTES(buffer_desc.length + mic_desc.length, 0);
+        emacs_value result_list[] = { make_message_status(result),
+                                      GSS_ERROR(result) ? Qnil : env->make_integer(env, qop_state),
+                                      make_supplementary_list(env, result) };
+        return env->funcall(env, Qlist, 3, result_list);
+    }
+    if(check_error(env, result, minor)) {
+        return Qnil;
+    }
+
+    STATS_BYTES(buffer_desc.length + mic_desc.length, 0);
+    emacs_value result_list[] = { env->make_integer(env, qop_state),
+                                  make_supplementary_list(env, result) };
+    return env->funcall(env, Qlist, 2, result_list);
+}
+
+static emacs_value make_result_vector(emacs_env *env, ptrdiff_t size)
+{
+    emacs_value args[] = { env->make_integer(env, size), Qnil };
+    return env->funcall(env, Qmake_vector, 2, args);
+}
+
+static emacs_value Fwrap_many(emacs_env *env, ptrdiff_t nargs, emacs_value *args, void *data)
+{
+    (void)data;
+    (void)nargs;
+
+    emacs_value context = args[0];
+    emacs_value buffers = args[1];
+    emacs_value conf = args[2];
+
+    gss_ctx_id_t context_handle = make_context_ref(env, context);
+    if(env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+        return Qnil;
+    }
+    int conf_req = env->is_not_nil(env, conf) ? 1 : 0;
+    ptrdiff_t n = env->vec_size(env, buffers);
+    emacs_value results = make_result_vector(env, n);
+    ScratchBuffer scratch = { NULL, 0 };
+
+    for(ptrdiff_t i = 0 ; i < n ; i++) {
+        gss_buffer_desc buffer_desc;
+        if(!fill_input_token(env, env->vec_get(env, buffers, i), &scratch, &buffer_desc)) {
+            pool_free(scratch.buf);
+            return Qnil;
+        }
+
+        int conf_state;
+        gss_buffer_desc output_desc;
+        OM_uint32 minor;
+        STATS_GSS_BEGIN();
+        OM_uint32 result = gss_wrap(&minor,
+                                    context_handle,
+                                    conf_req,
+                                    GSS_C_QOP_DEFAULT,
+                                    &buffer_desc,
+                                    &conf_state,
+                                    &output_desc);
+        STATS_GSS_END();
+        if(GSS_ERROR(result)) {
+            env->vec_set(env, results, i, xcons(env, Qgss_error, make_error_data(env, result, minor, GSS_C_NO_OID)));
+            continue;
+        }
+
+        STATS_BYTES(buffer_desc.length, output_desc.length);
+        emacs_value result_list[] = { make_bytes(env, output_desc.value, output_desc.length), conf_state ? Qt : Qnil };
+        env->vec_set(env, results, i, env->funcall(env, Qlist, 2, result_list));
+
+        result = gss_release_buffer(&minor, &output_desc);
+        if(check_error(env, result, minor)) {
+            pool_free(scratch.buf);
+            return Qnil;
+        }
+    }
+
+    pool_free(scratch.buf);
+    return results;
+}
+
+static emacs_value Funwrap_many(emacs_env *env, ptrdiff_t nargs, emacs_value *args, void *data)
+{
+    (void)data;
+    (void)nargs;
+
+    emacs_value context = args[0];
+    emacs_value buffers = args[1];
+
+    gss_ctx_id_t context_handle = make_context_ref(env, context);
+    if(env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+        return Qnil;
+    }
+    ptrdiff_t n = env->vec_size(env, buffers);
+    emacs_value results = make_result_vector(env, n);
+    ScratchBuffer scratch = { NULL, 0 };
+
+    for(ptrdiff_t i = 0 ; i < n ; i++) {
+        gss_buffer_desc buffer_desc;
+        if(!fill_input_token(env, env->vec_get(env, buffers, i), &scratch, &buffer_desc)) {
+            pool_free(scratch.buf);
+            return Qnil;
+        }
+
+        int conf_state;
+        gss_qop_t qop_state;
+        gss_buffer_desc output_desc;
+        OM_uint32 minor;
+        STATS_GSS_BEGIN();
+        OM_uint32 result = gss_unwrap(&minor,
+                                      context_handle,
+                                      &buffer_desc,
+                                      &output_desc,
+                                      &conf_state,
+                                      &qop_state);
+        STATS_GSS_END();
+        if(GSS_ERROR(result)) {
+            env->vec_set(env, results, i, xcons(env, Qgss_error, make_error_data(env, result, minor, GSS_C_NO_OID)));
+            continue;
+        }
+
+        STATS_BYTES(buffer_desc.length, output_desc.length);
+        emacs_value result_list[] = { make_bytes(env, output_desc.value, output_desc.length), conf_state ? Qt : Qnil };
+        env->vec_set(env, results, i, env->funcall(env, Qlist, 2, result_list));
+
+        result = gss_release_buffer(&minor, &output_desc);
+        if(check_error(env, result, minor)) {
+            pool_free(scratch.buf);
+            return Qnil;
+        }
+    }
+
+    pool_free(scratch.buf);
+    return results;
+}
+
+static emacs_value Fwrap_size_limit(emacs_env *env, ptrdiff_t nargs, emacs_value *args, void *data)
+{
+    (void)data;
+    (void)nargs;
+
+    emacs_value context = args[0];
+    emacs_value conf = args[1];
+    emacs_value req_output_size = args[2];
+
+    gss_ctx_id_t context_handle = make_context_ref(env, context);
+    if(env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+        return Qnil;
+    }
+    intmax_t output_size = env->extract_integer(env, req_output_size);
+    if(env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+        return Qnil;
+    }
+    if(output_size < 0 || output_size > UINT32_MAX) {
+        throw_error(env, "output size out of range");
+        return Qnil;
+    }
+    OM_uint32 max_input_size;
+
+    OM_uint32 minor;
+    STATS_GSS_BEGIN();
+    OM_uint32 result = gss_wrap_size_limit(&minor,
+                                           context_handle,
+                                           env->is_not_nil(env, conf) ? 1 : 0,
+                                           GSS_C_QOP_DEFAULT,
+                                           output_size,
+                                           &max_input_size);
+    STATS_GSS_END();
+    if(check_error(env, result, minor)) {
+        return Qnil;
+    }
+
+    return env->make_integer(env, max_input_size);
+}
+
+static emacs_value Finquire_context(emacs_env *env, ptrdiff_t nargs, emacs_value *args, void *data)
+{
+    (void)data;
+    (void)nargs;
+
+    emacs_value context = args[0];
+
+    gss_ctx_id_t context_handle = make_context_ref(env, context);
+    if(env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+        return Qnil;
+    }
+    OM_uint32 lifetime_rec;
+    OM_uint32 ctx_flags;
+    int locally_initiated;
+    int open;
+
+    OM_uint32 minor;
+    STATS_GSS_BEGIN();
+    OM_uint32 result = gss_inquire_context(&minor, context_handle, NULL, NULL, &lifetime_rec, NULL,
+                                           &ctx_flags, &locally_initiated, &open);
+    STATS_GSS_END();
+    if(check_error(env, result, minor)) {
+        return Qnil;
+    }
+
+    emacs_value result_list[] = { env->make_integer(env, lifetime_rec),
+                                  env->make_integer(env, ctx_flags),
+                                  locally_initiated ? Qt : Qnil,
+                                  open ? Qt : Qnil };
+    return env->funcall(env, Qlist, 4, result_list);
+}
+
+static void free_cred_store(gss_key_value_set_desc *store)
+{
+    for(OM_uint32 i = 0 ; i < store->count ; i++) {
+        pool_free((char *)store->elements[i].key);
+        pool_free((char *)store->elements[i].value);
+    }
+    free(store->elements);
+}
+
+// Builds a credential store from a vector of alternating keys and
+// values, such as ["ccache" "FILE:/tmp/krb5cc_1000"]
+static int make_cred_store(emacs_env *env, emacs_value options, gss_key_value_set_desc *store)
+{
+    store->count = 0;
+    store->elements = NULL;
+
+    if(!env->is_not_nil(env, options)) {
+        return 1;
+    }
+
+    ptrdiff_t size = env->vec_size(env, options);
+    if(env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+        return 0;
+    }
+    if(size % 2 != 0) {
+        emacs_value signal_args[] = { Qevenp, env->make_integer(env, size) };
+        env->non_local_exit_signal(env, Qwrong_type_argument, env->funcall(env, Qlist, 2, signal_args));
+        return 0;
+    }
+
+    ptrdiff_t n = size / 2;
+    store->elements = calloc(n, sizeof(gss_key_value_element_desc));
+    if(store->elements == NULL && n > 0) {
+        throw_error(env, "out of memory");
+        return 0;
+    }
+
+    for(ptrdiff_t i = 0 ; i < n ; i++) {
+        char *key = copy_string(env, env->vec_get(env, options, i * 2));
+        char *value = key == NULL ? NULL : copy_string(env, env->vec_get(env, options, i * 2 + 1));
+        if(value == NULL) {
+            pool_free(key);
+            free_cred_store(store);
+            return 0;
+        }
+        store->elements[i].key = key;
+        store->elements[i].value = value;
+        store->count++;
+    }
+
+    return 1;
+}
+
+static emacs_value Facquire_cred(emacs_env *env, ptrdiff_t nargs, emacs_value *args, void *data)
+{
+    (void)data;
+    (void)nargs;
+
+    emacs_value name = args[0];
+    emacs_value time_req = args[1];
+    emacs_value usage = args[2];
+    emacs_value options = args[3];
+
+    gss_cred_usage_t cred_usage;
+    if(env->eq(env, usage, Qinitiate)) {
+        cred_usage = GSS_C_INITIATE;
+    }
+    else if(env->eq(env, usage, Qaccept)) {
+        cred_usage = GSS_C_ACCEPT;
+    }
+    else if(env->eq(env, usage, Qboth)) {
+        cred_usage = GSS_C_BOTH;
+    }
+    else {
+        throw_error(env, "illegal usage");
+        return Qnil;
+    }
+
+    intmax_t time_req_value = env->extract_integer(env, time_req);
+    if(env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+        return Qnil;
+    }
+
+    gss_key_value_set_desc store;
+    if(!make_cred_store(env, options, &store)) {
+        return Qnil;
+    }
+
+    gss_name_t desired_name = env->is_not_nil(env, name) ? env->get_user_ptr(env, name) : GSS_C_NO_NAME;
+    gss_cred_id_t cred;
+    OM_uint32 time_rec;
+
+    OM_uint32 minor;
+    OM_uint32 result;
+    if(store.count > 0) {
+        STATS_GSS_BEGIN();
+        result = gss_acquire_cred_from(&minor, desired_name, time_req_value, GSS_C_NO_OID_SET,
+                                       cred_usage, &store, &cred, NULL, &time_rec);
+        STATS_GSS_END();
+    }
+    else {
+        STATS_GSS_BEGIN();
+        result = gss_acquire_cred(&minor, desired_name, time_req_value, GSS_C_NO_OID_SET,
+                                  cred_usage, &cred, NULL, &time_rec);
+        STATS_GSS_END();
+    }
+    free_cred_store(&store);
+    if(check_error(env, result, minor)) {
+        return Qnil;
+    }
+
+    emacs_value result_list[] = { make_cred_ptr(env, cred),
+                                  time_rec == GSS_C_INDEFINITE ? Qnil : env->make_integer(env, time_rec) };
+    return env->funcall(env, Qlist, 2, result_list);
+}
+
+static emacs_value Fset_default_cred_cache(emacs_env *env, ptrdiff_t nargs, emacs_value *args, void *data)
+{
+    (void)data;
+    (void)nargs;
+
+    use_default_cred_cache = env->is_not_nil(env, args[0]);
+    clear_default_cred();
+    return Qnil;
+}
+
+/*
+ * Asynchronous context establishment.
+ *
+ * Calls to gss_init_sec_context may block while the mechanism contacts
+ * the KDC. The async variant copies its arguments into a request which
+ * is processed by a fixed pool of worker threads. When a request
+ * completes, a byte is written to a channel opened on a pipe process,
+ * and the process filter collects the results on the main thread. The
+ * Emacs environment is never used from the worker threads.
+ */
+
+#define ASYNC_DEFAULT_THREADS 4
+#define ASYNC_MAX_THREADS 64
+
+typedef struct AsyncRequest {
+    struct AsyncRequest *next;
+    intmax_t id;
+    int cancelled;
+    int started;
+    // Set once the handles below have been pinned
+    int pinned;
+
+    // Global references which keep the Lisp objects used by the request
+    // alive until it has been collected
+    emacs_value target_ref;
+    emacs_value context_ref;
+    emacs_value cred_ref;
+
+    gss_cred_id_t cred;
+    gss_name_t target;
+    // NULL when a new context is being established. The wrapper is
+    // only accessed from the main thread.
+    ContextWrapper *context_wrapper;
+    OM_uint32 req_flags;
+    OM_uint32 time_req;
+    gss_buffer_desc input_token;
+
+    // Captured from the wrapper when the request is submitted, and owned
+    // by the request until it has been collected
+    gss_ctx_id_t context_handle;
+    OM_uint32 result;
+    OM_uint32 minor;
+    gss_OID mech_type;
+    gss_buffer_desc output_token;
+    OM_uint32 ret_flags;
+    OM_uint32 time_rec;
+} AsyncRequest;
+
+static pthread_mutex_t async_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t async_cond = PTHREAD_COND_INITIALIZER;
+static AsyncRequest *async_pending_head = NULL;
+static AsyncRequest *async_pending_tail = NULL;
+static AsyncRequest *async_running = NULL;
+static AsyncRequest *async_completed = NULL;
+static intmax_t async_next_id = 1;
+static int async_notify_fd = -1;
+static int async_thread_count = 0;
+
+static void remove_async_request(AsyncRequest **list, AsyncRequest *req)
+{
+    for(AsyncRequest **p = list ; *p != NULL ; p = &(*p)->next) {
+        if(*p == req) {
+            *p = req->next;
+            req->next = NULL;
+            return;
+        }
+    }
+}
+
+// Must only be called from the main thread
+static void free_async_request(emacs_env *env, AsyncRequest *req)
+{
+    OM_uint32 minor;
+    if(req->started && req->output_token.value != NULL) {
+        gss_release_buffer(&minor, &req->output_token);
+    }
+    if(req->pinned) {
+        // A context created by a cancelled request, or one deleted from
+        // Lisp while the request was in flight, is never handed back to
+        // Lisp, so it has to be deleted here.
+        int discarded = req->context_wrapper == NULL ? req->cancelled : req->context_wrapper->is_released;
+        if(discarded && req->context_handle != GSS_C_NO_CONTEXT) {
+            gss_delete_sec_context(&minor, &req->context_handle, GSS_C_NO_BUFFER);
+        }
+        if(req->context_wrapper != NULL) {
+            req->context_wrapper->is_busy = 0;
+        }
+        unpin_handle(req->cred);
+        unpin_handle(req->target);
+    }
+    env->free_global_ref(env, req->target_ref);
+    env->free_global_ref(env, req->context_ref);
+    env->free_global_ref(env, req->cred_ref);
+    free_input_token(&req->input_token);
+    free(req);
+}
+
+static void notify_async_completion(void)
+{
+    if(async_notify_fd >= 0) {
+        char c = 0;
+        while(write(async_notify_fd, &c, 1) < 0 && errno == EINTR) {
+        }
+    }
+}
+
+static void *async_worker(void *arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&async_mutex);
+    for(;;) {
+        while(async_pending_head == NULL) {
+            pthread_cond_wait(&async_cond, &async_mutex);
+        }
+
+        AsyncRequest *req = async_pending_head;
+        async_pending_head = req->next;
+        if(async_pending_head == NULL) {
+            async_pending_tail = NULL;
+        }
+        req->next = async_running;
+        async_running = req;
+        req->started = 1;
+        pthread_mutex_unlock(&async_mutex);
+
+        req->result = gss_init_sec_context(&req->minor, req->cred, &req->context_handle, req->target,
+                                           GSS_C_NO_OID, req->req_flags, req->time_req, GSS_C_NO_CHANNEL_BINDINGS,
+                                           &req->input_token, &req->mech_type, &req->output_token, &req->ret_flags, &req->time_rec);
+
+        pthread_mutex_lock(&async_mutex);
+        remove_async_request(&async_running, req);
+        req->next = async_completed;
+        async_completed = req;
+        notify_async_completion();
+    }
+
+    return NULL;
+}
+
+static emacs_value Fasync_init(emacs_env *env, ptrdiff_t nargs, emacs_value *args, void *data)
+{
+    (void)data;
+
+    emacs_value process = args[0];
+    intmax_t threads = nargs > 1 && env->is_not_nil(env, args[1]) ? env->extract_integer(env, args[1]) : ASYNC_DEFAULT_THREADS;
+
+    if((size_t)env->size < sizeof(struct emacs_env_28)) {
+        throw_error(env, "asynchronous operations require Emacs 28 or later");
+        return Qnil;
+    }
+    if(threads < 1 || threads > ASYNC_MAX_THREADS) {
+        throw_error(env, "illegal thread count");
+        return Qnil;
+    }
+
+    int fd = env->open_channel(env, process);
+    if(fd < 0) {
+        return Qnil;
+    }
+
+    pthread_mutex_lock(&async_mutex);
+    if(async_notify_fd >= 0) {
+        close(async_notify_fd);
+    }
+    async_notify_fd = fd;
+    int failed = 0;
+    while(async_thread_count < threads) {
+        pthread_t thread;
+        if(pthread_create(&thread, NULL, async_worker, NULL) != 0) {
+            failed = 1;
+            break;
+        }
+        pthread_detach(thread);
+        async_thread_count++;
+    }
+    // Requests may have completed while no channel was open
+    if(async_completed != NULL) {
+        notify_async_completion();
+    }
+    pthread_mutex_unlock(&async_mutex);
+
+    if(failed && async_thread_count == 0) {
+        throw_error(env, "unable to start worker thread");
+    }
+
+    return Qnil;
+}
+
+static emacs_value Finit_sec_context_async(emacs_env *env, ptrdiff_t nargs, emacs_value *args, void *data)
+{
+    (void)data;
+    (void)nargs;
+
+    emacs_value target = args[0];
+    emacs_value flags = args[1];
+    emacs_value context = args[2];
+    emacs_value time_req = args[3];
+    emacs_value content = args[4];
+    emacs_value cred = args[5];
+
+    if(async_thread_count == 0) {
+        throw_error(env, "asynchronous operations have not been initialised");
+        return Qnil;
+    }
+
+    AsyncRequest *req = calloc(1, sizeof(AsyncRequest));
+    if(req == NULL) {
+        throw_error(env, "out of memory");
+        return Qnil;
+    }
+
+    req->target_ref = env->make_global_ref(env, target);
+    req->context_ref = env->make_global_ref(env, context);
+    req->cred_ref = env->make_global_ref(env, cred);
+    req->cred = make_cred_ref(env, cred, 1);
+    req->target = env->get_user_ptr(env, target);
+    req->context_wrapper = env->is_not_nil(env, context) ? env->get_user_ptr(env, context) : NULL;
+    req->context_handle = make_context_ref(env, context);
+    req->req_flags = make_flags(env, flags);
+    req->time_req = env->extract_integer(env, time_req);
+    if(env->non_local_exit_check(env) != emacs_funcall_exit_return
+       || !make_input_token(env, content, &req->input_token)) {
+        free_async_request(env, req);
+        return Qnil;
+    }
+
+    if(!pin_handle(req->cred, 1)) {
+        free_async_request(env, req);
+        throw_error(env, "out of memory");
+        return Qnil;
+    }
+    if(!pin_handle(req->target, 0)) {
+        unpin_handle(req->cred);
+        free_async_request(env, req);
+        throw_error(env, "out of memory");
+        return Qnil;
+    }
+    req->pinned = 1;
+    if(req->context_wrapper != NULL) {
+        req->context_wrapper->is_busy = 1;
+    }
+
+    pthread_mutex_lock(&async_mutex);
+    req->id = async_next_id++;
+    if(async_pending_tail == NULL) {
+        async_pending_head = req;
+    }
+    else {
+        async_pending_tail->next = req;
+    }
+    async_pending_tail = req;
+    pthread_cond_signal(&async_cond);
+    pthread_mutex_unlock(&async_mutex);
+
+    return env->make_integer(env, req->id);
+}
+
+// Returns a list of (ID . RESULT) for each completed request, where
+// RESULT is the value gss--internal-init-sec-context would have
+// returned, a list starting with gss-error, or nil if the request was
+// cancelled.
+static emacs_value Fasync_collect(emacs_env *env, ptrdiff_t nargs, emacs_value *args, void *data)
+{
+    (void)data;
+    (void)nargs;
+    (void)args;
+
+    pthread_mutex_lock(&async_mutex);
+    AsyncRequest *completed = async_completed;
+    async_completed = NULL;
+    pthread_mutex_unlock(&async_mutex);
+
+    emacs_value ret = Qnil;
+    while(completed != NULL) {
+        AsyncRequest *req = completed;
+        completed = req->next;
+
+        emacs_value id = env->make_integer(env, req->id);
+        emacs_value value;
+        int deleted = req->context_wrapper != NULL && req->context_wrapper->is_released;
+        if(req->started && GSS_ERROR(req->result)) {
+            // The mechanism deletes the context when it fails
+            req->context_handle = GSS_C_NO_CONTEXT;
+            if(req->context_wrapper != NULL) {
+                mark_context_released(req->context_wrapper);
+            }
+        }
+        else if(req->context_wrapper != NULL && !deleted) {
+            req->context_wrapper->context = req->context_handle;
+        }
+        if(req->cancelled || deleted) {
+            value = Qnil;
+        }
+        else if(GSS_ERROR(req->result)) {
+            value = xcons(env, Qgss_error, make_error_data(env, req->result, req->minor, req->mech_type));
+        }
+        else {
+            value = make_init_sec_context_result(env, req->result, req->context_ref, req->context_handle,
+                                                 &req->output_token, req->ret_flags, req->time_rec, 0);
+            req->context_handle = GSS_C_NO_CONTEXT;
+        }
+        free_async_request(env, req);
+        ret = xcons(env, xcons(env, id, value), ret);
+    }
+
+    return ret;
+}
+
+// Cancels a request. A request which has not yet started is never
+// sent to the mechanism. The result of a running request is discarded
+// when it completes. In both cases the request is reported as
+// cancelled by gss--internal-async-collect.
+static emacs_value Fasync_cancel(emacs_env *env, ptrdiff_t nargs, emacs_value *args, void *data)
+{
+    (void)data;
+    (void)nargs;
+
+    intmax_t id = env->extract_integer(env, args[0]);
+    int found = 0;
+
+    pthread_mutex_lock(&async_mutex);
+    AsyncRequest *prev = NULL;
+    for(AsyncRequest *req = async_pending_head ; req != NULL ; prev = req, req = req->next) {
+        if(req->id == id) {
+            if(prev == NULL) {
+                async_pending_head = req->next;
+            }
+            else {
+                prev->next = req->next;
+            }
+            if(async_pending_tail == req) {
+                async_pending_tail = prev;
+            }
+            req->cancelled = 1;
+            req->next = async_completed;
+            async_completed = req;
+            notify_async_completion();
+            found = 1;
+            break;
+        }
+    }
+    AsyncRequest *lists[] = { async_running, async_completed };
+    for(int i = 0 ; i < 2 && !found ; i++) {
+        for(AsyncRequest *req = lists[i] ; req != NULL ; req = req->next) {
+            if(req->id == id) {
+                req->cancelled = 1;
+                found = 1;
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&async_mutex);
+
+    return found ? Qt : Qnil;
+}
+
+/*
+ * Batch acceptor.
+ *
+ * gss--internal-accept-many runs gss_accept_sec_context for a set of
+ * independent tokens on a fixed pool of worker threads, with the main
+ * thread taking part as well. The call returns when every token has
+ * been processed, and all Lisp values are created on the main thread.
+ */
+
+typedef struct {
+    gss_ctx_id_t context_handle;
+    gss_cred_id_t acceptor_cred;
+    gss_buffer_desc input_token;
+    OM_uint32 result;
+    OM_uint32 minor;
+    gss_name_t src_name;
+    gss_OID mech_type;
+    gss_buffer_desc output_token;
+    OM_uint32 ret_flags;
+    OM_uint32 time_rec;
+    gss_cred_id_t delegated_cred;
+} AcceptJob;
+
+typedef struct {
+    AcceptJob *jobs;
+    size_t count;
+    size_t next;
+    size_t done;
+    // Number of worker threads which may take part, besides the main
+    // thread, and the number which have joined so far
+    int max_workers;
+    int workers;
+} AcceptBatch;
+
+static pthread_mutex_t accept_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t accept_work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t accept_done_cond = PTHREAD_COND_INITIALIZER;
+static AcceptBatch *accept_batch = NULL;
+static int accept_thread_count = 0;
+
+static void run_accept_job(AcceptJob *job)
+{
+    job->src_name = GSS_C_NO_NAME;
+    job->mech_type = GSS_C_NO_OID;
+    job->output_token.value = NULL;
+    job->output_token.length = 0;
+    job->delegated_cred = GSS_C_NO_CREDENTIAL;
+    job->result = gss_accept_sec_context(&job->minor, &job->context_handle, job->acceptor_cred, &job->input_token,
+                                         GSS_C_NO_CHANNEL_BINDINGS, &job->src_name, &job->mech_type, &job->output_token,
+                                         &job->ret_flags, &job->time_rec, &job->delegated_cred);
+}
+
+// Runs jobs from the current batch until there are none left. Must be
+// called with accept_mutex held.
+static void run_accept_jobs(void)
+{
+    while(accept_batch != NULL && accept_batch->next < accept_batch->count) {
+        AcceptBatch *batch = accept_batch;
+        AcceptJob *job = &batch->jobs[batch->next++];
+        pthread_mutex_unlock(&accept_mutex);
+        run_accept_job(job);
+        pthread_mutex_lock(&accept_mutex);
+        if(++batch->done == batch->count) {
+            pthread_cond_signal(&accept_done_cond);
+        }
+    }
+}
+
+static void *accept_worker(void *arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&accept_mutex);
+    for(;;) {
+        while(accept_batch == NULL || accept_batch->next >= accept_batch->count
+              || accept_batch->workers >= accept_batch->max_workers) {
+            pthread_cond_wait(&accept_work_cond, &accept_mutex);
+        }
+        accept_batch->workers++;
+        run_accept_jobs();
+    }
+
+    return NULL;
+}
+
+static void start_accept_threads(int threads)
+{
+    while(accept_thread_count < threads) {
+        pthread_t thread;
+        if(pthread_create(&thread, NULL, accept_worker, NULL) != 0) {
+            // The main thread processes the batch on its own if needed
+            break;
+        }
+        pthread_detach(thread);
+        accept_thread_count++;
+    }
+}
+
+static emacs_value make_accept_job_result(emacs_env *env, AcceptJob *job, emacs_value context)
+{
+    OM_uint32 minor;
+
+    if(job->delegated_cred != GSS_C_NO_CREDENTIAL) {
+        gss_release_cred(&minor, &job->delegated_cred);
+    }
+
+    if(GSS_ERROR(job->result)) {
+        if(env->is_not_nil(env, context)) {
+            mark_context_released(env->get_user_ptr(env, context));
+        }
+        if(job->output_token.value != NULL) {
+            gss_release_buffer(&minor, &job->output_token);
+        }
+        return xcons(env, Qgss_error, make_error_data(env, job->result, job->minor, job->mech_type));
+    }
+
+    emacs_value context_ret;
+    if(job->context_handle == GSS_C_NO_CONTEXT) {
+        context_ret = Qnil;
+    }
+    else if(env->is_not_nil(env, context)) {
+        context_ret = context;
+    }
+    else {
+        context_ret = make_context_ptr(env, job->context_handle);
+    }
+
+    emacs_value result_list[] = { job->result & GSS_S_CONTINUE_NEEDED ? Qt : Qnil,
+                                  context_ret,
+                                  make_name_ptr(env, job->src_name),
+                                  job->output_token.length == 0 ? Qnil : make_bytes(env, job->output_token.value, job->output_token.length),
+                                  env->make_integer(env, job->ret_flags),
+                                  env->make_integer(env, job->time_rec),
+                                  Qnil };
+    gss_release_buffer(&minor, &job->output_token);
+
+    return env->funcall(env, Qlist, 7, result_list);
+}
+
+static int compare_contexts(const void *a, const void *b)
+{
+    uintptr_t x = (uintptr_t)*(const gss_ctx_id_t *)a;
+    uintptr_t y = (uintptr_t)*(const gss_ctx_id_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Returns 1 if an existing context is used by more than one job in
+// BATCH, since two threads must never process the same context, and -1
+// if memory could not be allocated.
+static int has_duplicate_context(AcceptBatch *batch)
+{
+    gss_ctx_id_t *handles = malloc(batch->count * sizeof(gss_ctx_id_t));
+    if(handles == NULL) {
+        return -1;
+    }
+    size_t count = 0;
+    for(size_t i = 0 ; i < batch->count ; i++) {
+        if(batch->jobs[i].context_handle != GSS_C_NO_CONTEXT) {
+            handles[count++] = batch->jobs[i].context_handle;
+        }
+    }
+    qsort(handles, count, sizeof(gss_ctx_id_t), compare_contexts);
+    int duplicate = 0;
+    for(size_t i = 1 ; i < count && !duplicate ; i++) {
+        duplicate = handles[i] == handles[i - 1];
+    }
+    free(handles);
+    return duplicate;
+}
+
+// Takes a vector of tokens and a vector of the same length containing
+// the context for each token, or nil for new contexts. A context must
+// not appear more than once in a batch. Returns a vector of results,
+// where a failed element is a list starting with gss-error.
+static emacs_value Faccept_many(emacs_env *env, ptrdiff_t nargs, emacs_value *args, void *data)
+{
+    (void)data;
+
+    emacs_value tokens = args[0];
+    emacs_value contexts = args[1];
+    intmax_t threads = env->extract_integer(env, args[2]);
+    emacs_value cred = nargs > 3 ? args[3] : Qnil;
+    gss_cred_id_t cred_handle = make_cred_ref(env, cred, 0);
+    if(env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+        return Qnil;
+    }
+
+    ptrdiff_t n = env->vec_size(env, tokens);
+    if(env->vec_size(env, contexts) != n) {
+        throw_error(env, "token and context vectors have different lengths");
+        return Qnil;
+    }
+    if(threads < 0 || threads > ASYNC_MAX_THREADS) {
+        throw_error(env, "illegal thread count");
+        return Qnil;
+    }
+
+    AcceptBatch batch = { calloc(n, sizeof(AcceptJob)), n, 0, 0, threads, 0 };
+    if(batch.jobs == NULL && n > 0) {
+        throw_error(env, "out of memory");
+        return Qnil;
+    }
+
+    for(ptrdiff_t i = 0 ; i < n ; i++) {
+        batch.jobs[i].context_handle = make_context_ref(env, env->vec_get(env, contexts, i));
+        batch.jobs[i].acceptor_cred = cred_handle;
+        if(env->non_local_exit_check(env) != emacs_funcall_exit_return
+           || !make_input_token(env, env->vec_get(env, tokens, i), &batch.jobs[i].input_token)) {
+            break;
+        }
+    }
+    if(env->non_local_exit_check(env) == emacs_funcall_exit_return && n > 0) {
+        int duplicate = has_duplicate_context(&batch);
+        if(duplicate < 0) {
+            throw_error(env, "out of memory");
+        }
+        else if(duplicate) {
+            throw_error(env, "context appears more than once in batch");
+        }
+    }
+    if(env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+        for(ptrdiff_t i = 0 ; i < n ; i++) {
+            free_input_token(&batch.jobs[i].input_token);
+        }
+        free(batch.jobs);
+        return Qnil;
+    }
+
+    // A release of the credential from Lisp is deferred until the
+    // worker threads are done with it
+    if(!pin_handle(cred_handle, 1)) {
+        for(ptrdiff_t i = 0 ; i < n ; i++) {
+            free_input_token(&batch.jobs[i].input_token);
+        }
+        free(batch.jobs);
+        throw_error(env, "out of memory");
+        return Qnil;
+    }
+
+    STATS_GSS_BEGIN();
+    pthread_mutex_lock(&accept_mutex);
+    start_accept_threads(threads);
+    accept_batch = &batch;
+    pthread_cond_broadcast(&accept_work_cond);
+    run_accept_jobs();
+    while(batch.done < batch.count) {
+        pthread_cond_wait(&accept_done_cond, &accept_mutex);
+    }
+    accept_batch = NULL;
+    pthread_mutex_unlock(&accept_mutex);
+    STATS_GSS_END();
+    unpin_handle(cred_handle);
+
+    emacs_value results = make_result_vector(env, n);
+    for(ptrdiff_t i = 0 ; i < n ; i++) {
+        free_input_token(&batch.jobs[i].input_token);
+        env->vec_set(env, results, i, make_accept_job_result(env, &batch.jobs[i], env->vec_get(env, contexts, i)));
+    }
+    free(batch.jobs);
+
+    return results;
+}
+
+// Exporting a context deactivates it, so the wrapper is marked as
+// released and can't be used afterwards.
+static emacs_value Fexport_sec_context(emacs_env *env, ptrdiff_t nargs, emacs_value *args, void *data)
+{
+    (void)data;
+    (void)nargs;
+
+    emacs_value context = args[0];
+
+    make_context_ref(env, context);
+    if(env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+        return Qnil;
+    }
+    ContextWrapper *context_wrapper = env->get_user_ptr(env, context);
+
+    gss_buffer_desc interprocess_token;
+
+    OM_uint32 minor;
+    STATS_GSS_BEGIN();
+    OM_uint32 result = gss_export_sec_context(&minor, &context_wrapper->context, &interprocess_token);
+    STATS_GSS_END();
+    if(check_error(env, result, minor)) {
+        return Qnil;
+    }
+
+    mark_context_released(context_wrapper);
+
+    emacs_value ret = make_bytes(env, interprocess_token.value, interprocess_token.length);
+
+    result = gss_release_buffer(&minor, &interprocess_token);
+    if(check_error(env, result, minor)) {
+        return Qnil;
+    }
+
+    return ret;
+}
+
+static emacs_value Fimport_sec_context(emacs_env *env, ptrdiff_t nargs, emacs_value *args, void *data)
+{
+    (void)data;
+    (void)nargs;
+
+    emacs_value token = args[0];
+
+    gss_buffer_desc interprocess_token;
+    if(!make_input_token(env, token, &interprocess_token)) {
+        return Qnil;
+    }
+    gss_ctx_id_t context_handle = GSS_C_NO_CONTEXT;
+
+    OM_uint32 minor;
+    STATS_GSS_BEGIN();
+    OM_uint32 result = gss_import_sec_context(&minor, &interprocess_token, &context_handle);
+    STATS_GSS_END();
+    free_input_token(&interprocess_token);
+    if(check_error(env, result, minor)) {
+        return Qnil;
+    }
+
+    return make_context_ptr(env, context_handle);
+}
+
+// Renders a status code as a list of strings. MECH is the mechanism OID
+// as returned in the error data, or nil for the Kerberos mechanism.
+static emacs_value Fdisplay_status(emacs_env *env, ptrdiff_t nargs, emacs_value *args, void *data)
+{
+    (void)data;
+    (void)nargs;
+
+    OM_uint32 status = env->extract_integer(env, args[0]);
+    int status_code_type = env->is_not_nil(env, args[1]) ? GSS_C_MECH_CODE : GSS_C_GSS_CODE;
+    emacs_value mech = args[2];
+
+    if(status_code_type == GSS_C_GSS_CODE) {
+        return extract_error_message(env, status, GSS_C_GSS_CODE, GSS_C_NO_OID);
+    }
+
+    if(!env->is_not_nil(env, mech)) {
+        return extract_error_message(env, status, GSS_C_MECH_CODE, (gss_OID)gss_mech_krb5);
+    }
+
+    gss_buffer_desc mech_buf;
+    if(!make_input_token(env, mech, &mech_buf)) {
+        return Qnil;
+    }
+    gss_OID_desc mech_oid = { mech_buf.length, mech_buf.value };
+    emacs_value ret = extract_error_message(env, status, GSS_C_MECH_CODE, &mech_oid);
+    free_input_token(&mech_buf);
+    return ret;
+}
+
+/*
+ * Protected transport for network processes.
+ *
+ * Messages are framed as a 4-byte big-endian length followed by the
+ * wrapped token, like the streaming functions in gss.el. The receiving
+ * side keeps the partial frame in a Transport, so that a process filter
+ * can hand every chunk of output to a single call which returns the
+ * plaintext of all the frames it completes.
+ */
+
+#define TRANSPORT_HEADER_LENGTH 4
+
+typedef struct {
+    unsigned char *buf;
+    size_t length;
+    size_t size;
+    size_t max_frame;
+    // Set if received frames must be encrypted
+    int conf_req;
+} Transport;
+
+static void free_transport(void *transport_ptr)
+{
+    Transport *transport = transport_ptr;
+    pool_free(transport->buf);
+    free(transport);
+}
+
+// Takes the largest accepted frame length, in bytes, and whether
+// received frames must be encrypted
+static emacs_value Ftransport_new(emacs_env *env, ptrdiff_t nargs, emacs_value *args, void *data)
+{
+    (void)data;
+
+    intmax_t max_frame = env->extract_integer(env, args[0]);
+    int conf_req = nargs > 1 && env->is_not_nil(env, args[1]);
+    if(env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+        return Qnil;
+    }
+    if(max_frame <= 0) {
+        throw_error(env, "maximum frame length must be positive");
+        return Qnil;
+    }
+
+    Transport *transport = calloc(1, sizeof(Transport));
+    if(transport == NULL) {
+        throw_error(env, "out of memory");
+        return Qnil;
+    }
+    transport->max_frame = max_frame;
+    transport->conf_req = conf_req;
+    return env->make_user_ptr(env, free_transport, transport);
+}
+
+// Takes a transport, a context and a string received from the peer.
+// Returns (PLAINTEXT ERROR), where PLAINTEXT is the concatenated
+// plaintext of the frames completed by the string, and ERROR is nil or
+// the data of a gss-error for a frame which failed to unwrap. Frames
+// which fail are dropped, and processing continues with the next one.
+// A replayed or out of sequence frame is dropped as well, and reported
+// with its supplementary status bits. An unencrypted frame received on
+// a transport which requires confidentiality is reported as
+// GSS_S_FAILURE.
+static emacs_value Ftransport_unwrap(emacs_env *env, ptrdiff_t nargs, emacs_value *args, void *data)
+{
+    (void)data;
+    (void)nargs;
+
+    Transport *transport = env->get_user_ptr(env, args[0]);
+    gss_ctx_id_t context_handle = make_context_ref(env, args[1]);
+    emacs_value chunk = args[2];
+    if(env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+        return Qnil;
+    }
+
+    // Append the chunk directly to the pending data
+    if(!copy_string_bytes(env, chunk, &transport->buf, &transport->size, &transport->length)) {
+        return Qnil;
+    }
+
+    unsigned char *plaintext = NULL;
+    size_t plaintext_length = 0;
+    size_t plaintext_size = 0;
+    emacs_value error = Qnil;
+    size_t offset = 0;
+    uint64_t bytes_in = 0;
+
+    while(transport->length - offset >= TRANSPORT_HEADER_LENGTH) {
+        unsigned char *p = transport->buf + offset;
+        size_t frame_length = ((size_t)p[0] << 24) | ((size_t)p[1] << 16) | ((size_t)p[2] << 8) | p[3];
+        if(frame_length > transport->max_frame) {
+            // The stream can't be resynchronised
+            transport->length = 0;
+            offset = 0;
+            pool_free(plaintext);
+            throw_error(env, "frame exceeds the maximum length");
+            return Qnil;
+        }
+        if(transport->length - offset - TRANSPORT_HEADER_LENGTH < frame_length) {
+            break;
+        }
+
+        gss_buffer_desc token = { frame_length, p + TRANSPORT_HEADER_LENGTH };
+        gss_buffer_desc output;
+        int conf_state;
+        OM_uint32 minor;
+        STATS_GSS_BEGIN();
+        OM_uint32 result = gss_unwrap(&minor, context_handle, &token, &output, &conf_state, NULL);
+        STATS_GSS_END();
+        offset += TRANSPORT_HEADER_LENGTH + frame_length;
+        bytes_in += frame_length;
+        int rejected = !GSS_ERROR(result) && (GSS_SUPPLEMENTARY_INFO(result) != 0 || (transport->conf_req && !conf_state));
+        if(rejected) {
+            OM_uint32 release_minor;
+            gss_release_buffer(&release_minor, &output);
+            if(GSS_SUPPLEMENTARY_INFO(result) == 0) {
+                result = GSS_S_FAILURE;
+                minor = 0;
+            }
+        }
+        if(rejected || GSS_ERROR(result)) {
+            if(!env->is_not_nil(env, error)) {
+                error = make_error_data(env, result, minor, GSS_C_NO_OID);
+            }
+            continue;
+        }
+
+        int ok = grow_buffer(&plaintext, &plaintext_size, plaintext_length, plaintext_length + output.length);
+        if(ok && output.length > 0) {
+            memcpy(plaintext + plaintext_length, output.value, output.length);
+            plaintext_length += output.length;
+        }
+        gss_release_buffer(&minor, &output);
+        if(!ok) {
+            pool_free(plaintext);
+            throw_error(env, "out of memory");
+            return Qnil;
+        }
+    }
+
+    if(offset > 0) {
+        memmove(transport->buf, transport->buf + offset, transport->length - offset);
+        transport->length -= offset;
+    }
+
+    STATS_BYTES(bytes_in, plaintext_length);
+    emacs_value result_list[] = { make_bytes(env, plaintext, plaintext_length), error };
+    pool_free(plaintext);
+    return env->funcall(env, Qlist, 2, result_list);
+}
+
+// Takes a context, the data to send, whether to request confidentiality
+// and the largest plaintext to put in one frame, or 0 for no limit.
+// Returns the framed tokens, ready to be sent to the peer.
+static emacs_value Ftransport_wrap(emacs_env *env, ptrdiff_t nargs, emacs_value *args, void *data)
+{
+    (void)data;
+    (void)nargs;
+
+    gss_ctx_id_t context_handle = make_context_ref(env, args[0]);
+    int conf_req = env->is_not_nil(env, args[2]);
+    intmax_t max_chunk = env->extract_integer(env, args[3]);
+    if(env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+        return Qnil;
+    }
+    gss_buffer_desc input;
+    if(!make_input_token(env, args[1], &input)) {
+        return Qnil;
+    }
+
+    size_t chunk = max_chunk <= 0 || (size_t)max_chunk > input.length ? input.length : (size_t)max_chunk;
+    unsigned char *out = NULL;
+    size_t out_length = 0;
+    size_t out_size = 0;
+    size_t offset = 0;
+
+    // An empty message is still sent as one frame
+    do {
+        size_t length = input.length - offset < chunk ? input.length - offset : chunk;
+        gss_buffer_desc piece = { length, (char *)input.value + offset };
+        gss_buffer_desc token;
+        OM_uint32 minor;
+        STATS_GSS_BEGIN();
+        OM_uint32 result = gss_wrap(&minor, context_handle, conf_req, GSS_C_QOP_DEFAULT, &piece, NULL, &token);
+        STATS_GSS_END();
+        if(GSS_ERROR(result)) {
+            free_input_token(&input);
+            pool_free(out);
+            check_error(env, result, minor);
+            return Qnil;
+        }
+
+        int ok = grow_buffer(&out, &out_size, out_length, out_length + TRANSPORT_HEADER_LENGTH + token.length);
+        if(ok) {
+            unsigned char *p = out + out_length;
+            p[0] = token.length >> 24;
+            p[1] = token.length >> 16;
+            p[2] = token.length >> 8;
+            p[3] = token.length;
+            memcpy(p + TRANSPORT_HEADER_LENGTH, token.value, token.length);
+            out_length += TRANSPORT_HEADER_LENGTH + token.length;
+        }
+        gss_release_buffer(&minor, &token);
+        if(!ok) {
+            free_input_token(&input);
+            pool_free(out);
+            throw_error(env, "out of memory");
+            return Qnil;
+        }
+        offset += length;
+    } while(offset < input.length);
+
+    STATS_BYTES(input.length, out_length);
+    free_input_token(&input);
+    emacs_value ret = make_bytes(env, out, out_length);
+    pool_free(out);
+    return ret;
+}
+
+/*
+ * Replay of a trace through an acceptor. The acceptor consumes the
+ * output tokens of TRACE_INIT records and the input tokens of
+ * TRACE_ACCEPT records, so traces recorded on either side can be
+ * replayed. Wrap and unwrap records are replayed as a gss_wrap of a
+ * message of the recorded size on the context established for the same
+ * recorded context, since the unwrap input is not recorded.
+ *
+ * Every authenticator in the trace has been seen before, so the
+ * acceptor credential should have its replay cache disabled, for
+ * example with an "rcache" entry of "none:" in its credential store;
+ * gss-trace-replay does this. The acceptor still checks the
+ * authenticator timestamps against its clock skew allowance and the
+ * ticket end times, so a trace can only be replayed while its tickets
+ * are valid and within the clockskew set in krb5.conf, 300 seconds by
+ * default.
+ */
+
+typedef struct {
+    uint64_t recorded_id;
+    gss_ctx_id_t context;
+} ReplayContext;
+
+#define REPLAY_MAX_CONTEXTS 65536
+
+static void clear_replay_contexts(ReplayContext *contexts)
+{
+    for(size_t i = 0 ; i < REPLAY_MAX_CONTEXTS ; i++) {
+        if(contexts[i].context != GSS_C_NO_CONTEXT) {
+            OM_uint32 minor;
+            gss_delete_sec_context(&minor, &contexts[i].context, GSS_C_NO_BUFFER);
+        }
+    }
+    memset(contexts, 0, REPLAY_MAX_CONTEXTS * sizeof(ReplayContext));
+}
+
+static ReplayContext *find_replay_context(ReplayContext *contexts, uint64_t recorded_id, int create)
+{
+    // Zero marks free entries, and is never a valid key since user space
+    // addresses don't have the top bit set
+    uint64_t key = recorded_id | ((uint64_t)1 << 63);
+    size_t start = (recorded_id >> 4) % REPLAY_MAX_CONTEXTS;
+    for(size_t i = 0 ; i < REPLAY_MAX_CONTEXTS ; i++) {
+        ReplayContext *entry = &contexts[(start + i) % REPLAY_MAX_CONTEXTS];
+        if(entry->recorded_id == key) {
+            return entry;
+        }
+        if(entry->recorded_id == 0) {
+            if(create) {
+                entry->recorded_id = key;
+                entry->context = GSS_C_NO_CONTEXT;
+                return entry;
+            }
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+#define REPLAY_QUIT_POLL_NS 50000000
+
+static int replay_should_quit(emacs_env *env)
+{
+    return (size_t)env->size >= sizeof(struct emacs_env_26) && env->should_quit(env);
+}
+
+static int compare_uint64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Takes the name of a trace file, an acceptor credential or nil,
+// whether to reproduce the original pacing, and the type of the
+// records whose tokens are replayed, TRACE_INIT or TRACE_ACCEPT, or 0
+// for both. Returns (ACCEPTS ERRORS
+// WRAPS SKIPPED ELAPSED-NS P50-NS P99-NS MAX-NS), where the percentiles
+// are accept latencies. A paced replay can be interrupted with C-g, in
+// which case nil is returned.
+static emacs_value Ftrace_replay(emacs_env *env, ptrdiff_t nargs, emacs_value *args, void *data)
+{
+    (void)data;
+
+    gss_cred_id_t cred = make_cred_ref(env, args[1], 0);
+    int paced = env->is_not_nil(env, args[2]);
+    intmax_t source = nargs > 3 ? env->extract_integer(env, args[3]) : 0;
+    if(env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+        return Qnil;
+    }
+
+    char *filename = copy_string(env, args[0]);
+    if(filename == NULL) {
+        return Qnil;
+    }
+    FILE *file = fopen(filename, "rb");
+    pool_free(filename);
+    if(file == NULL) {
+        throw_error(env, "unable to open trace file");
+        return Qnil;
+    }
+
+    char magic[sizeof(TRACE_MAGIC) - 1];
+    uint32_t header[2];
+    if(fread(magic, sizeof(magic), 1, file) != 1 || memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0
+       || fread(header, sizeof(header), 1, file) != 1
+       || header[0] != TRACE_VERSION || header[1] != TRACE_BYTE_ORDER) {
+        fclose(file);
+        throw_error(env, "not a trace file, or recorded on a different architecture");
+        return Qnil;
+    }
+
+    ReplayContext *contexts = calloc(REPLAY_MAX_CONTEXTS, sizeof(ReplayContext));
+    uint64_t *latencies = NULL;
+    size_t latencies_size = 0;
+    unsigned char *buf = NULL;
+    size_t buf_size = 0;
+    uint64_t accepts = 0;
+    uint64_t errors = 0;
+    uint64_t wraps = 0;
+    uint64_t skipped = 0;
+    int failed = contexts == NULL;
+    int quit = 0;
+    uint64_t start = monotonic_ns();
+    uint64_t first_time = 0;
+    int first = 1;
+
+    TraceRecord record;
+    while(!failed && fread(&record, sizeof(record), 1, file) == 1) {
+        size_t length = (size_t)record.in_length + record.out_length;
+        int has_data = record.type == TRACE_INIT || record.type == TRACE_ACCEPT;
+        if(has_data && !grow_buffer(&buf, &buf_size, 0, length)) {
+            failed = 1;
+            break;
+        }
+        if(has_data && length > 0 && fread(buf, length, 1, file) != 1) {
+            break;
+        }
+
+        if(paced) {
+            if(first) {
+                first_time = record.time_ns;
+                first = 0;
+            }
+            // The wait is split into short sleeps so that a quit is
+            // noticed promptly
+            uint64_t target = start + (record.time_ns - first_time);
+            uint64_t now;
+            while(!(quit = replay_should_quit(env)) && target > (now = monotonic_ns())) {
+                uint64_t wait = target - now < REPLAY_QUIT_POLL_NS ? target - now : REPLAY_QUIT_POLL_NS;
+                struct timespec delay = { wait / 1000000000, wait % 1000000000 };
+                nanosleep(&delay, NULL);
+            }
+            if(quit) {
+                break;
+            }
+        }
+
+        gss_buffer_desc token = { 0, NULL };
+        if(record.type == TRACE_INIT && !GSS_ERROR(record.major)) {
+            token.length = record.out_length;
+            token.value = buf + record.in_length;
+        }
+        else if(record.type == TRACE_ACCEPT) {
+            token.length = record.in_length;
+            token.value = buf;
+        }
+
+        OM_uint32 minor;
+        if(record.type == TRACE_WRAP || record.type == TRACE_UNWRAP) {
+            ReplayContext *entry = find_replay_context(contexts, record.context_id, 0);
+            size_t size = record.type == TRACE_WRAP ? record.in_length : record.out_length;
+            if(entry == NULL || entry->context == GSS_C_NO_CONTEXT || !grow_buffer(&buf, &buf_size, 0, size)) {
+                skipped++;
+                continue;
+            }
+            memset(buf, 0, size);
+            gss_buffer_desc message = { size, buf };
+            gss_buffer_desc output;
+            OM_uint32 result = gss_wrap(&minor, entry->context, record.flags & TRACE_FLAG_CONF,
+                                        GSS_C_QOP_DEFAULT, &message, NULL, &output);
+            if(GSS_ERROR(result)) {
+                errors++;
+            }
+            else {
+                gss_release_buffer(&minor, &output);
+                wraps++;
+            }
+            continue;
+        }
+        if(token.length == 0 || (source != 0 && record.type != source)) {
+            skipped++;
+            continue;
+        }
+
+        ReplayContext *entry = find_replay_context(contexts, record.context_id, 1);
+        if(entry == NULL) {
+            // The table is full; the contexts of older handshakes are dropped
+            clear_replay_contexts(contexts);
+            entry = find_replay_context(contexts, record.context_id, 1);
+        }
+        if((record.flags & TRACE_FLAG_NEW) && entry->context != GSS_C_NO_CONTEXT) {
+            // The recorded handle has been reused for a new context
+            gss_delete_sec_context(&minor, &entry->context, GSS_C_NO_BUFFER);
+        }
+
+        gss_buffer_desc output_token;
+        uint64_t call_start = monotonic_ns();
+        OM_uint32 result = gss_accept_sec_context(&minor, &entry->context, cred, &token, GSS_C_NO_CHANNEL_BINDINGS,
+                                                  NULL, NULL, &output_token, NULL, NULL, NULL);
+        uint64_t elapsed = monotonic_ns() - call_start;
+        if(GSS_ERROR(result)) {
+            errors++;
+            entry->context = GSS_C_NO_CONTEXT;
+            continue;
+        }
+        gss_release_buffer(&minor, &output_token);
+
+        if(accepts == latencies_size) {
+            size_t new_size = latencies_size == 0 ? 1024 : latencies_size * 2;
+            uint64_t *new_latencies = realloc(latencies, new_size * sizeof(uint64_t));
+            if(new_latencies == NULL) {
+                failed = 1;
+                break;
+            }
+            latencies = new_latencies;
+            latencies_size = new_size;
+        }
+        latencies[accepts++] = elapsed;
+    }
+    uint64_t total_ns = monotonic_ns() - start;
+    fclose(file);
+
+    if(contexts != NULL) {
+        clear_replay_contexts(contexts);
+        free(contexts);
+    }
+    pool_free(buf);
+
+    if(failed) {
+        free(latencies);
+        throw_error(env, "out of memory");
+        return Qnil;
+    }
+    if(quit) {
+        // Emacs signals the quit when the function returns
+        free(latencies);
+        return Qnil;
+    }
+
+    if(accepts > 0) {
+        qsort(latencies, accepts, sizeof(uint64_t), compare_uint64);
+    }
+    emacs_value result_list[] = { env->make_integer(env, accepts),
+                                  env->make_integer(env, errors),
+                                  env->make_integer(env, wraps),
+                                  env->make_integer(env, skipped),
+                                  env->make_integer(env, total_ns),
+                                  accepts == 0 ? Qnil : env->make_integer(env, latencies[accepts / 2]),
+                                  accepts == 0 ? Qnil : env->make_integer(env, latencies[accepts * 99 / 100]),
+                                  accepts == 0 ? Qnil : env->make_integer(env, latencies[accepts - 1]) };
+    free(latencies);
+    return env->funcall(env, Qlist, 8, result_list);
+}
+
+/*
+ * SASL GSSAPI mechanism (RFC 4752), client side.
+ *
+ * The state machine is kept in the module so that every SASL step is a
+ * single call. The context and the target name are owned by Lisp and
+ * passed to every step, like for gss--internal-init-sec-context. Once
+ * the security layer has been negotiated, the maximum plaintext size
+ * that can be wrapped for the server is computed with
+ * gss_wrap_size_limit.
+ */
+
+#define SASL_LAYER_NONE 1
+#define SASL_LAYER_INTEGRITY 2
+#define SASL_LAYER_CONFIDENTIALITY 4
+#define SASL_MAX_BUFFER 0xffffff
+
+enum {
+    SASL_ESTABLISHING,
+    SASL_SECURITY_LAYER,
+    SASL_DONE
+};
+
+typedef struct {
+    int state;
+    OM_uint32 req_flags;
+    OM_uint32 ret_flags;
+    // Security layers acceptable to the client
+    int layers;
+    OM_uint32 client_max_buffer;
+    char *authzid;
+    size_t authzid_length;
+
+    // Results of the security layer negotiation
+    int layer;
+    OM_uint32 server_max_buffer;
+    OM_uint32 wrap_limit;
+} SaslState;
+
+static void free_sasl(void *sasl_ptr)
+{
+    SaslState *sasl = sasl_ptr;
+    pool_free(sasl->authzid);
+    free(sasl);
+}
+
+// Takes the request flags, a bitmask of the acceptable security layers,
+// the maximum size of a message the client can receive, and an
+// authorization identity or nil.
+static emacs_value Fsasl_new(emacs_env *env, ptrdiff_t nargs, emacs_value *args, void *data)
+{
+    (void)data;
+    (void)nargs;
+
+    OM_uint32 req_flags = make_flags(env, args[0]);
+    intmax_t layers = env->extract_integer(env, args[1]);
+    intmax_t max_buffer = env->extract_integer(env, args[2]);
+    emacs_value authzid = args[3];
+    if(env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+        return Qnil;
+    }
+    if((layers & (SASL_LAYER_NONE | SASL_LAYER_INTEGRITY | SASL_LAYER_CONFIDENTIALITY)) == 0) {
+        throw_error(env, "no SASL security layer allowed");
+        return Qnil;
+    }
+    if(max_buffer < 0 || max_buffer > SASL_MAX_BUFFER) {
+        throw_error(env, "invalid SASL maximum buffer size");
+        return Qnil;
+    }
+
+    SaslState *sasl = calloc(1, sizeof(SaslState));
+    if(sasl == NULL) {
+        throw_error(env, "out of memory");
+        return Qnil;
+    }
+    sasl->state = SASL_ESTABLISHING;
+    sasl->layers = layers;
+    sasl->client_max_buffer = max_buffer;
+    // Integrity and confidentiality are needed by the security layers
+    sasl->req_flags = req_flags;
+    if(layers & (SASL_LAYER_INTEGRITY | SASL_LAYER_CONFIDENTIALITY)) {
+        sasl->req_flags |= GSS_C_INTEG_FLAG;
+    }
+    if(layers & SASL_LAYER_CONFIDENTIALITY) {
+        sasl->req_flags |= GSS_C_CONF_FLAG;
+    }
+    if(env->is_not_nil(env, authzid)) {
+        sasl->authzid = copy_string(env, authzid);
+        if(sasl->authzid == NULL) {
+            free(sasl);
+            return Qnil;
+        }
+        sasl->authzid_length = strlen(sasl->authzid);
+    }
+
+    return env->make_user_ptr(env, free_sasl, sasl);
+}
+
+static emacs_value sasl_establish(emacs_env *env, SaslState *sasl, emacs_value target, emacs_value context,
+                                  emacs_value challenge, emacs_value cred)
+{
+    gss_cred_id_t cred_handle = make_cred_ref(env, cred, 1);
+    gss_ctx_id_t context_handle = make_context_ref(env, context);
+    if(env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+        return Qnil;
+    }
+    gss_buffer_desc input_token;
+    if(!make_input_token(env, challenge, &input_token)) {
+        return Qnil;
+    }
+    gss_OID actual_mech_type = GSS_C_NO_OID;
+    gss_buffer_desc output_token;
+    OM_uint32 ret_flags;
+
+    OM_uint32 minor;
+    STATS_GSS_BEGIN();
+    OM_uint32 result = gss_init_sec_context(&minor, cred_handle, &context_handle, env->get_user_ptr(env, target),
+                                            (gss_OID)gss_mech_krb5, sasl->req_flags, 0, GSS_C_NO_CHANNEL_BINDINGS,
+                                            &input_token, &actual_mech_type, &output_token, &ret_flags, NULL);
+    STATS_GSS_END();
+    free_input_token(&input_token);
+    if(GSS_ERROR(result)) {
+        if(env->is_not_nil(env, context)) {
+            mark_context_released(env->get_user_ptr(env, context));
+        }
+        check_error_mech(env, result, minor, actual_mech_type);
+        return Qnil;
+    }
+    STATS_BYTES(input_token.length, output_token.length);
+
+    if(!(result & GSS_S_CONTINUE_NEEDED)) {
+        sasl->state = SASL_SECURITY_LAYER;
+        sasl->ret_flags = ret_flags;
+    }
+
+    emacs_value context_ret = env->is_not_nil(env, context) ? context : make_context_ptr(env, context_handle);
+    // An empty response is still sent when the context is complete
+    emacs_value response = make_bytes(env, output_token.value, output_token.length);
+    result = gss_release_buffer(&minor, &output_token);
+    if(check_error(env, result, minor)) {
+        return Qnil;
+    }
+
+    emacs_value result_list[] = { Qnil, context_ret, response };
+    return env->funcall(env, Qlist, 3, result_list);
+}
+
+// Returns the strongest layer offered by the server which is acceptable
+// to the client and supported by the context, or 0.
+static int sasl_choose_layer(SaslState *sasl, int server_layers)
+{
+    int candidates = server_layers & sasl->layers;
+    if(!(sasl->ret_flags & GSS_C_CONF_FLAG)) {
+        candidates &= ~SASL_LAYER_CONFIDENTIALITY;
+    }
+    if(!(sasl->ret_flags & GSS_C_INTEG_FLAG)) {
+        candidates &= ~(SASL_LAYER_INTEGRITY | SASL_LAYER_CONFIDENTIALITY);
+    }
+    if(candidates & SASL_LAYER_CONFIDENTIALITY) {
+        return SASL_LAYER_CONFIDENTIALITY;
+    }
+    if(candidates & SASL_LAYER_INTEGRITY) {
+        return SASL_LAYER_INTEGRITY;
+    }
+    if(candidates & SASL_LAYER_NONE) {
+        return SASL_LAYER_NONE;
+    }
+    return 0;
+}
+
+static emacs_value sasl_security_layer(emacs_env *env, SaslState *sasl, emacs_value context, emacs_value challenge)
+{
+    if(!env->is_not_nil(env, context)) {
+        throw_error(env, "SASL security layer negotiation needs a context");
+        return Qnil;
+    }
+    gss_ctx_id_t context_handle = make_context_ref(env, context);
+    if(env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+        return Qnil;
+    }
+
+    gss_buffer_desc input_token;
+    if(!make_input_token(env, challenge, &input_token)) {
+        return Qnil;
+    }
+    gss_buffer_desc message;
+    OM_uint32 minor;
+    STATS_GSS_BEGIN();
+    OM_uint32 result = gss_unwrap(&minor, context_handle, &input_token, &message, NULL, NULL);
+    STATS_GSS_END();
+    free_input_token(&input_token);
+    if(check_error(env, result, minor)) {
+        return Qnil;
+    }
+    if(message.length != 4) {
+        gss_release_buffer(&minor, &message);
+        throw_error(env, "invalid SASL security layer message");
+        return Qnil;
+    }
+    unsigned char *p = message.value;
+    int server_layers = p[0];
+    OM_uint32 server_max_buffer = ((OM_uint32)p[1] << 16) | ((OM_uint32)p[2] << 8) | p[3];
+    gss_release_buffer(&minor, &message);
+
+    int layer = sasl_choose_layer(sasl, server_layers);
+    if(layer == 0) {
+        throw_error(env, "no acceptable SASL security layer");
+        return Qnil;
+    }
+    OM_uint32 client_max_buffer = layer == SASL_LAYER_NONE ? 0 : sasl->client_max_buffer;
+
+    size_t length = 4 + sasl->authzid_length;
+    unsigned char *buf = pool_alloc(length);
+    if(buf == NULL) {
+        throw_error(env, "out of memory");
+        return Qnil;
+    }
+    buf[0] = layer;
+    buf[1] = client_max_buffer >> 16;
+    buf[2] = client_max_buffer >> 8;
+    buf[3] = client_max_buffer;
+    if(sasl->authzid_length > 0) {
+        memcpy(buf + 4, sasl->authzid, sasl->authzid_length);
+    }
+
+    gss_buffer_desc reply = { length, buf };
+    gss_buffer_desc output_token;
+    STATS_GSS_BEGIN();
+    result = gss_wrap(&minor, context_handle, 0, GSS_C_QOP_DEFAULT, &reply, NULL, &output_token);
+    STATS_GSS_END();
+    pool_free(buf);
+    if(check_error(env, result, minor)) {
+        return Qnil;
+    }
+
+    OM_uint32 wrap_limit = 0;
+    if(layer != SASL_LAYER_NONE && server_max_buffer > 0) {
+        STATS_GSS_BEGIN();
+        result = gss_wrap_size_limit(&minor, context_handle, layer == SASL_LAYER_CONFIDENTIALITY,
+                                     GSS_C_QOP_DEFAULT, server_max_buffer, &wrap_limit);
+        STATS_GSS_END();
+        if(check_error(env, result, minor)) {
+            gss_release_buffer(&minor, &output_token);
+            return Qnil;
+        }
+    }
+
+    sasl->layer = layer;
+    sasl->server_max_buffer = server_max_buffer;
+    sasl->wrap_limit = wrap_limit;
+    sasl->state = SASL_DONE;
+
+    STATS_BYTES(input_token.length, output_token.length);
+    emacs_value response = make_bytes(env, output_token.value, output_token.length);
+    result = gss_release_buffer(&minor, &output_token);
+    if(check_error(env, result, minor)) {
+        return Qnil;
+    }
+
+    emacs_value result_list[] = { Qt, context, response };
+    return env->funcall(env, Qlist, 3, result_list);
+}
+
+// Takes the SASL state, the target name, the context or nil, the
+// server challenge or nil, and a credential or nil. Returns (DONE
+// CONTEXT RESPONSE), where RESPONSE is the data to send to the server,
+// possibly empty.
+static emacs_value Fsasl_step(emacs_env *env, ptrdiff_t nargs, emacs_value *args, void *data)
+{
+    (void)data;
+    (void)nargs;
+
+    SaslState *sasl = env->get_user_ptr(env, args[0]);
+    if(sasl == NULL) {
+        return Qnil;
+    }
+
+    switch(sasl->state) {
+    case SASL_ESTABLISHING:
+        return sasl_establish(env, sasl, args[1], args[2], args[3], args[4]);
+    case SASL_SECURITY_LAYER:
+        return sasl_security_layer(env, sasl, args[2], args[3]);
+    default:
+        throw_error(env, "SASL negotiation is already complete");
+        return Qnil;
+    }
+}
+
+// Returns (DONE LAYER SERVER-MAX-BUFFER CLIENT-MAX-BUFFER WRAP-LIMIT).
+// LAYER, the buffer sizes and WRAP-LIMIT are nil until the security
+// layer has been negotiated.
+static emacs_value Fsasl_info(emacs_env *env, ptrdiff_t nargs, emacs_value *args, void *data)
+{
+    (void)data;
+    (void)nargs;
+
+    SaslState *sasl = env->get_user_ptr(env, args[0]);
+    if(sasl == NULL) {
+        return Qnil;
+    }
+
+    int done = sasl->state == SASL_DONE;
+    emacs_value result_list[] = { done ? Qt : Qnil,
+                                  done ? env->make_integer(env, sasl->layer) : Qnil,
+                                  done ? env->make_integer(env, sasl->server_max_buffer) : Qnil,
+                                  done ? env->make_integer(env, sasl->layer == SASL_LAYER_NONE ? 0 : sasl->client_max_buffer) : Qnil,
+                                  done ? env->make_integer(env, sasl->wrap_limit) : Qnil };
+    return env->funcall(env, Qlist, 5, result_list);
+}
+
+/*
+ * Pseudo-random function and bulk data channel.
+ *
+ * A bulk channel encrypts large streams without a gss_wrap call per
+ * chunk. It uses AES-256-GCM through the OpenSSL EVP interface, which
+ * runs on the AES and carry-less multiply instructions where the CPU
+ * has them. A key and a nonce salt are derived for each direction from
+ * the established context with gss_pseudo_random. The PRF input ends
+ * with a label which the application passes on both sides, so the
+ * channels of a context have independent keys. Each chunk is framed as
+ * a 4-byte big-endian length, an 8-byte sequence number, and the
+ * ciphertext followed by the tag. The nonce is the salt followed by
+ * the sequence number, and the length and sequence number are
+ * authenticated as additional data. The receiver requires the sequence
+ * numbers to be consecutive, so that dropped, replayed or reordered
+ * chunks are detected.
+ */
+
+#define BULK_HEADER_LENGTH 4
+#define BULK_SEQUENCE_LENGTH 8
+#define BULK_TAG_LENGTH 16
+#define BULK_KEY_LENGTH 32
+#define BULK_SALT_LENGTH 4
+#define BULK_NONCE_LENGTH (BULK_SALT_LENGTH + BULK_SEQUENCE_LENGTH)
+#define BULK_DIRECTION_LENGTH (BULK_KEY_LENGTH + BULK_SALT_LENGTH)
+// The NUL terminator separates the fixed input from the label
+#define BULK_PRF_INPUT "emacs-gssapi bulk channel"
+#define BULK_PRF_INPUT_LENGTH sizeof(BULK_PRF_INPUT)
+// EVP takes lengths as int
+#define BULK_MAX_CHUNK_SIZE (INT_MAX - BULK_SEQUENCE_LENGTH - BULK_TAG_LENGTH)
+
+typedef struct {
+    EVP_CIPHER_CTX *send_cipher;
+    EVP_CIPHER_CTX *receive_cipher;
+    unsigned char send_salt[BULK_SALT_LENGTH];
+    unsigned char receive_salt[BULK_SALT_LENGTH];
+    uint64_t send_sequence;
+    uint64_t receive_sequence;
+    size_t chunk_size;
+    unsigned char *buf;
+    size_t length;
+    size_t size;
+} BulkChannel;
+
+static void free_bulk_channel(void *channel_ptr)
+{
+    BulkChannel *channel = channel_ptr;
+    EVP_CIPHER_CTX_free(channel->send_cipher);
+    EVP_CIPHER_CTX_free(channel->receive_cipher);
+    pool_free(channel->buf);
+    OPENSSL_cleanse(channel, sizeof(BulkChannel));
+    free(channel);
+}
+
+// Returns a cipher context keyed with KEY, or NULL. The nonce is set
+// for every chunk.
+static EVP_CIPHER_CTX *make_bulk_cipher(const unsigned char *key, int encrypt)
+{
+    EVP_CIPHER_CTX *cipher = EVP_CIPHER_CTX_new();
+    if(cipher == NULL) {
+        return NULL;
+    }
+    if(EVP_CipherInit_ex(cipher, EVP_aes_256_gcm(), NULL, key, NULL, encrypt) != 1) {
+        EVP_CIPHER_CTX_free(cipher);
+        return NULL;
+    }
+    return cipher;
+}
+
+static void put_sequence(unsigned char *p, uint64_t sequence)
+{
+    for(int i = BULK_SEQUENCE_LENGTH - 1 ; i >= 0 ; i--) {
+        p[i] = sequence;
+        sequence >>= 8;
+    }
+}
+
+static uint64_t get_sequence(const unsigned char *p)
+{
+    uint64_t sequence = 0;
+    for(int i = 0 ; i < BULK_SEQUENCE_LENGTH ; i++) {
+        sequence = (sequence << 8) | p[i];
+    }
+    return sequence;
+}
+
+// Takes a context, the PRF input and the number of bytes to produce.
+// If the fourth argument is non-nil, the key which is only available
+// to the initiator and acceptor of the context is not required.
+static emacs_value Fpseudo_random(emacs_env *env, ptrdiff_t nargs, emacs_value *args, void *data)
+{
+    (void)data;
+
+    gss_ctx_id_t context_handle = make_context_ref(env, args[0]);
+    intmax_t length = env->extract_integer(env, args[2]);
+    int prf_key = nargs > 3 && env->is_not_nil(env, args[3]) ? GSS_C_PRF_KEY_PARTIAL : GSS_C_PRF_KEY_FULL;
+    if(env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+        return Qnil;
+    }
+    if(length <= 0) {
+        throw_error(env, "output length must be positive");
+        return Qnil;
+    }
+    gss_buffer_desc input;
+    if(!make_input_token(env, args[1], &input)) {
+        return Qnil;
+    }
+
+    gss_buffer_desc output;
+    OM_uint32 minor;
+    STATS_GSS_BEGIN();
+    OM_uint32 result = gss_pseudo_random(&minor, context_handle, prf_key, &input, length, &output);
+    STATS_GSS_END();
+    free_input_token(&input);
+    if(check_error(env, result, minor)) {
+        return Qnil;
+    }
+
+    emacs_value ret = make_bytes(env, output.value, output.length);
+    gss_release_buffer(&minor, &output);
+    return ret;
+}
+
+// Takes an established context, a label and the largest plaintext to
+// put in one chunk. Both peers must pass the same label and chunk size.
+// The label is part of the PRF input, so channels with different
+// labels have independent keys. Reusing a label on the same context
+// would reuse nonces, and is rejected.
+static emacs_value Fbulk_new(emacs_env *env, ptrdiff_t nargs, emacs_value *args, void *data)
+{
+    (void)data;
+    (void)nargs;
+
+    ContextWrapper *context_wrapper = env->get_user_ptr(env, args[0]);
+    gss_ctx_id_t context_handle = make_context_ref(env, args[0]);
+    intmax_t chunk_size = env->extract_integer(env, args[2]);
+    if(env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+        return Qnil;
+    }
+    if(chunk_size <= 0 || chunk_size > BULK_MAX_CHUNK_SIZE) {
+        throw_error(env, "chunk size out of range");
+        return Qnil;
+    }
+
+    OM_uint32 minor;
+    int locally_initiated;
+    int open;
+    STATS_GSS_BEGIN();
+    OM_uint32 result = gss_inquire_context(&minor, context_handle, NULL, NULL, NULL, NULL, NULL, &locally_initiated, &open);
+    STATS_GSS_END();
+    if(check_error(env, result, minor)) {
+        return Qnil;
+    }
+    if(!open) {
+        throw_error(env, "context is not established");
+        return Qnil;
+    }
+
+    gss_buffer_desc label;
+    if(!make_input_token(env, args[1], &label)) {
+        return Qnil;
+    }
+    for(BulkLabel *used = context_wrapper->bulk_labels ; used != NULL ; used = used->next) {
+        if(used->length == label.length && memcmp(used->label, label.value, label.length) == 0) {
+            free_input_token(&label);
+            throw_error(env, "bulk channel label is already in use on this context");
+            return Qnil;
+        }
+    }
+    BulkLabel *new_label = malloc(sizeof(BulkLabel) + label.length);
+    unsigned char *prf_input = pool_alloc(BULK_PRF_INPUT_LENGTH + label.length);
+    if(new_label == NULL || prf_input == NULL) {
+        free(new_label);
+        pool_free(prf_input);
+        free_input_token(&label);
+        throw_error(env, "out of memory");
+        return Qnil;
+    }
+    new_label->length = label.length;
+    memcpy(new_label->label, label.value, label.length);
+    memcpy(prf_input, BULK_PRF_INPUT, BULK_PRF_INPUT_LENGTH);
+    memcpy(prf_input + BULK_PRF_INPUT_LENGTH, label.value, label.length);
+    free_input_token(&label);
+
+    // The first half of the PRF output keys the initiator to acceptor
+    // direction and the second half the reverse
+    gss_buffer_desc input = { BULK_PRF_INPUT_LENGTH + new_label->length, prf_input };
+    gss_buffer_desc output;
+    STATS_GSS_BEGIN();
+    result = gss_pseudo_random(&minor, context_handle, GSS_C_PRF_KEY_FULL, &input, 2 * BULK_DIRECTION_LENGTH, &output);
+    STATS_GSS_END();
+    pool_free(prf_input);
+    if(check_error(env, result, minor)) {
+        free(new_label);
+        return Qnil;
+    }
+    if(output.length != 2 * BULK_DIRECTION_LENGTH) {
+        OPENSSL_cleanse(output.value, output.length);
+        gss_release_buffer(&minor, &output);
+        free(new_label);
+        throw_error(env, "short pseudo-random output");
+        return Qnil;
+    }
+
+    BulkChannel *channel = calloc(1, sizeof(BulkChannel));
+    if(channel == NULL) {
+        OPENSSL_cleanse(output.value, output.length);
+        gss_release_buffer(&minor, &output);
+        free(new_label);
+        throw_error(env, "out of memory");
+        return Qnil;
+    }
+
+    unsigned char *initiator_keys = output.value;
+    unsigned char *acceptor_keys = initiator_keys + BULK_DIRECTION_LENGTH;
+    unsigned char *send_keys = locally_initiated ? initiator_keys : acceptor_keys;
+    unsigned char *receive_keys = locally_initiated ? acceptor_keys : initiator_keys;
+    channel->send_cipher = make_bulk_cipher(send_keys, 1);
+    channel->receive_cipher = make_bulk_cipher(receive_keys, 0);
+    memcpy(channel->send_salt, send_keys + BULK_KEY_LENGTH, BULK_SALT_LENGTH);
+    memcpy(channel->receive_salt, receive_keys + BULK_KEY_LENGTH, BULK_SALT_LENGTH);
+    OPENSSL_cleanse(output.value, output.length);
+    gss_release_buffer(&minor, &output);
+    if(channel->send_cipher == NULL || channel->receive_cipher == NULL) {
+        free_bulk_channel(channel);
+        free(new_label);
+        throw_error(env, "failed to create the bulk keys");
+        return Qnil;
+    }
+
+    channel->chunk_size = chunk_size;
+    new_label->next = context_wrapper->bulk_labels;
+    context_wrapper->bulk_labels = new_label;
+    return env->make_user_ptr(env, free_bulk_channel, channel);
+}
+
+static void make_bulk_nonce(unsigned char *nonce, const unsigned char *salt, const unsigned char *sequence)
+{
+    memcpy(nonce, salt, BULK_SALT_LENGTH);
+    memcpy(nonce + BULK_SALT_LENGTH, sequence, BULK_SEQUENCE_LENGTH);
+}
+
+// Takes a bulk channel and the data to send. Returns the framed
+// chunks, ready to be sent to the peer.
+static emacs_value Fbulk_encrypt(emacs_env *env, ptrdiff_t nargs, emacs_value *args, void *data)
+{
+    (void)data;
+    (void)nargs;
+
+    BulkChannel *channel = env->get_user_ptr(env, args[0]);
+    if(env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+        return Qnil;
+    }
+    gss_buffer_desc input;
+    if(!make_input_token(env, args[1], &input)) {
+        return Qnil;
+    }
+
+    // The output is allocated once, and each chunk is encrypted
+    // straight from the input into it
+    size_t chunks = input.length == 0 ? 1 : (input.length + channel->chunk_size - 1) / channel->chunk_size;
+    size_t overhead = BULK_HEADER_LENGTH + BULK_SEQUENCE_LENGTH + BULK_TAG_LENGTH;
+    unsigned char *out = pool_alloc(input.length + chunks * overhead);
+    if(out == NULL) {
+        free_input_token(&input);
+        throw_error(env, "out of memory");
+        return Qnil;
+    }
+
+    char *failure = NULL;
+    size_t out_length = 0;
+    size_t offset = 0;
+    STATS_GSS_BEGIN();
+    // An empty message is still sent as one chunk
+    do {
+        size_t length = input.length - offset < channel->chunk_size ? input.length - offset : channel->chunk_size;
+        if(channel->send_sequence == UINT64_MAX) {
+            failure = "bulk channel sequence numbers exhausted";
+            break;
+        }
+
+        unsigned char *p = out + out_length;
+        size_t frame_length = BULK_SEQUENCE_LENGTH + length + BULK_TAG_LENGTH;
+        p[0] = frame_length >> 24;
+        p[1] = frame_length >> 16;
+        p[2] = frame_length >> 8;
+        p[3] = frame_length;
+        put_sequence(p + BULK_HEADER_LENGTH, channel->send_sequence);
+
+        unsigned char nonce[BULK_NONCE_LENGTH];
+        make_bulk_nonce(nonce, channel->send_salt, p + BULK_HEADER_LENGTH);
+        unsigned char *ciphertext = p + BULK_HEADER_LENGTH + BULK_SEQUENCE_LENGTH;
+        int n;
+        if(EVP_EncryptInit_ex(channel->send_cipher, NULL, NULL, NULL, nonce) != 1
+           || EVP_EncryptUpdate(channel->send_cipher, NULL, &n, p, BULK_HEADER_LENGTH + BULK_SEQUENCE_LENGTH) != 1
+           || EVP_EncryptUpdate(channel->send_cipher, ciphertext, &n, (unsigned char *)input.value + offset, length) != 1
+           || EVP_EncryptFinal_ex(channel->send_cipher, ciphertext + length, &n) != 1
+           || EVP_CIPHER_CTX_ctrl(channel->send_cipher, EVP_CTRL_GCM_GET_TAG, BULK_TAG_LENGTH, ciphertext + length) != 1) {
+            failure = "bulk encryption failed";
+            break;
+        }
+
+        channel->send_sequence++;
+        out_length += BULK_HEADER_LENGTH + frame_length;
+        offset += length;
+    } while(offset < input.length);
+    STATS_GSS_END();
+
+    if(failure == NULL) {
+        STATS_BYTES(input.length, out_length);
+    }
+    free_input_token(&input);
+    if(failure != NULL) {
+        pool_free(out);
+        throw_error(env, failure);
+        return Qnil;
+    }
+
+    emacs_value ret = make_bytes(env, out, out_length);
+    pool_free(out);
+    return ret;
+}
+
+// Takes a bulk channel and a string received from the peer. Returns
+// the concatenated plaintext of the chunks completed by the string. A
+// chunk which fails to decrypt, or arrives out of sequence, signals an
+// error and leaves the channel unusable for receiving.
+static emacs_value Fbulk_decrypt(emacs_env *env, ptrdiff_t nargs, emacs_value *args, void *data)
+{
+    (void)data;
+    (void)nargs;
+
+    BulkChannel *channel = env->get_user_ptr(env, args[0]);
+    emacs_value chunk = args[1];
+    if(env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+        return Qnil;
+    }
+    if(channel->receive_cipher == NULL) {
+        throw_error(env, "bulk channel has failed");
+        return Qnil;
+    }
+
+    // Append the chunk directly to the pending data
+    if(!copy_string_bytes(env, chunk, &channel->buf, &channel->size, &channel->length)) {
+        return Qnil;
+    }
+
+    // The plaintext is never longer than the pending data, so it is
+    // decrypted in place and compacted at the start of the buffer
+    size_t max_frame = BULK_SEQUENCE_LENGTH + channel->chunk_size + BULK_TAG_LENGTH;
+    size_t min_frame = BULK_SEQUENCE_LENGTH + BULK_TAG_LENGTH;
+    size_t plaintext_length = 0;
+    size_t offset = 0;
+    uint64_t bytes_in = 0;
+    char *failure = NULL;
+
+    STATS_GSS_BEGIN();
+    while(channel->length - offset >= BULK_HEADER_LENGTH) {
+        unsigned char *p = channel->buf + offset;
+        size_t frame_length = ((size_t)p[0] << 24) | ((size_t)p[1] << 16) | ((size_t)p[2] << 8) | p[3];
+        if(frame_length > max_frame || frame_length < min_frame) {
+            failure = "bulk chunk has an invalid length";
+            break;
+        }
+        if(channel->length - offset - BULK_HEADER_LENGTH < frame_length) {
+            break;
+        }
+        if(get_sequence(p + BULK_HEADER_LENGTH) != channel->receive_sequence) {
+            failure = "bulk chunk is out of sequence";
+            break;
+        }
+
+        unsigned char nonce[BULK_NONCE_LENGTH];
+        make_bulk_nonce(nonce, channel->receive_salt, p + BULK_HEADER_LENGTH);
+        unsigned char *ciphertext = p + BULK_HEADER_LENGTH + BULK_SEQUENCE_LENGTH;
+        size_t length = frame_length - BULK_SEQUENCE_LENGTH - BULK_TAG_LENGTH;
+        int n;
+        if(EVP_DecryptInit_ex(channel->receive_cipher, NULL, NULL, NULL, nonce) != 1
+           || EVP_DecryptUpdate(channel->receive_cipher, NULL, &n, p, BULK_HEADER_LENGTH + BULK_SEQUENCE_LENGTH) != 1
+           || EVP_DecryptUpdate(channel->receive_cipher, ciphertext, &n, ciphertext, length) != 1
+           || EVP_CIPHER_CTX_ctrl(channel->receive_cipher, EVP_CTRL_GCM_SET_TAG, BULK_TAG_LENGTH, ciphertext + length) != 1
+           || EVP_DecryptFinal_ex(channel->receive_cipher, ciphertext + length, &n) != 1) {
+            failure = "bulk chunk failed to decrypt";
+            break;
+        }
+
+        memmove(channel->buf + plaintext_length, ciphertext, length);
+        plaintext_length += length;
+        channel->receive_sequence++;
+        offset += BULK_HEADER_LENGTH + frame_length;
+        bytes_in += frame_length;
+    }
+    STATS_GSS_END();
+
+    if(failure != NULL) {
+        // The stream can't be resynchronised
+        EVP_CIPHER_CTX_free(channel->receive_cipher);
+        channel->receive_cipher = NULL;
+        channel->length = 0;
+        throw_error(env, failure);
+        return Qnil;
+    }
+
+    STATS_BYTES(bytes_in, plaintext_length);
+    emacs_value ret = make_bytes(env, channel->buf, plaintext_length);
+    memmove(channel->buf, channel->buf + offset, channel->length - offset);
+    channel->length -= offset;
+    return ret;
+}
+
+int emacs_module_init(struct emacs_runtime *ert)
+{
+    emacs_env *env = ert->get_environment(ert);
+
+    init_symbols(env);
+    init_base64();
+
+    emacs_value make_name_fn = make_module_function(env, 2, 2, Fgssapi_internal_import_name, "integrate gss_import_name", "gss--internal-import-name");
+    bind_function(env, "gss--internal-import-name", make_name_fn);
+
+    emacs_value name_to_string_fn = make_module_function(env, 1, 1, Fgssapi_internal_name_to_string, "integrate gss_display_name", "gss--internal-name-to-string");
+    bind_function(env, "gss--internal-name-to-string", name_to_string_fn);
+
+    emacs_value canonicalize_name_fn = make_module_function(env, 1, 1, Fgssapi_internal_canonicalize_name, "integrate gss_canonicalize_name", "gss--internal-canonicalize-name");
+    bind_function(env, "gss--internal-canonicalize-name", canonicalize_name_fn);
+
+    emacs_value init_sec_context_fn = make_module_function(env, 5, 6, Fgssapi_internal_init_sec_context, "integrate gss_init_sec_context", "gss--internal-init-sec-context");
+    bind_function(env, "gss--internal-init-sec-context", init_sec_context_fn);
+
+    emacs_value accept_sec_context_fn = make_module_function(env, 2, 3, Fgssapi_internal_accept_sec_context, "integrate gss_accept_sec_context", "gss--internal-accept-sec-context");
+    bind_function(env, "gss--internal-accept-sec-context", accept_sec_context_fn);
+
+    emacs_value register_acceptor_identity_fn = make_module_function(env, 1, 1, Fregister_acceptor_identity, "integrate krb5_gss_register_acceptor_identity", "gss--internal-krb5-register-acceptor-identity");
+    bind_function(env, "gss--internal-krb5-register-acceptor-identity", register_acceptor_identity_fn);
+
+    emacs_value wrap_fn = make_module_function(env, 3, 3, Fwrap, "integrates gss_wrap", "gss--internal-wrap");
+    bind_function(env, "gss--internal-wrap", wrap_fn);
+
+    emacs_value unwrap_fn = make_module_function(env, 2, 3, Funwrap, "integrates gss_unwrap", "gss--internal-unwrap");
+    bind_function(env, "gss--internal-unwrap", unwrap_fn);
+
+    emacs_value wrap_many_fn = make_module_function(env, 3, 3, Fwrap_many, "integrates gss_wrap on a vector of buffers", "gss--internal-wrap-many");
+    bind_function(env, "gss--internal-wrap-many", wrap_many_fn);
+
+    emacs_value unwrap_many_fn = make_module_function(env, 2, 2, Funwrap_many, "integrates gss_unwrap on a vector of buffers", "gss--internal-unwrap-many");
+    bind_function(env, "gss--internal-unwrap-many", unwrap_many_fn);
+
+    emacs_value wrap_iov_fn = make_module_function(env, 3, 3, Fwrap_iov, "integrates gss_wrap_iov", "gss--internal-wrap-iov");
+    bind_function(env, "gss--internal-wrap-iov", wrap_iov_fn);
+
+    emacs_value unwrap_iov_fn = make_module_function(env, 2, 2, Funwrap_iov, "integrates gss_unwrap_iov", "gss--internal-unwrap-iov");
+    bind_function(env, "gss--internal-unwrap-iov", unwrap_iov_fn);
+
+    emacs_value get_mic_fn = make_module_function(env, 2, 2, Fget_mic, "integrates gss_get_mic", "gss--internal-get-mic");
+    bind_function(env, "gss--internal-get-mic", get_mic_fn);
+
+    emacs_value verify_mic_fn = make_module_function(env, 3, 4, Fverify_mic, "integrates gss_verify_mic", "gss--internal-verify-mic");
+    bind_function(env, "gss--internal-verify-mic", verify_mic_fn);
+
+    emacs_value wrap_size_limit_fn = make_module_function(env, 3, 3, Fwrap_size_limit, "integrates gss_wrap_size_limit", "gss--internal-wrap-size-limit");
+    bind_function(env, "gss--internal-wrap-size-limit", wrap_size_limit_fn);
+
+    emacs_value inquire_context_fn = make_module_function(env, 1, 1, Finquire_context, "integrates gss_inquire_context", "gss--internal-inquire-context");
+    bind_function(env, "gss--internal-inquire-context", inquire_context_fn);
+
+    emacs_value acquire_cred_fn = make_module_function(env, 4, 4, Facquire_cred, "integrates gss_acquire_cred", "gss--internal-acquire-cred");
+    bind_function(env, "gss--internal-acquire-cred", acquire_cred_fn);
+
+    emacs_value set_default_cred_cache_fn = make_module_function(env, 1, 1, Fset_default_cred_cache, "enable caching of the default initiator credential", "gss--internal-set-default-cred-cache");
+    bind_function(env, "gss--internal-set-default-cred-cache", set_default_cred_cache_fn);
+
+    emacs_value async_init_fn = make_module_function(env, 1, 2, Fasync_init, "start the worker threads for asynchronous operations", "gss--internal-async-init");
+    bind_function(env, "gss--internal-async-init", async_init_fn);
+
+    emacs_value init_sec_context_async_fn = make_module_function(env, 6, 6, Finit_sec_context_async, "integrate gss_init_sec_context on a worker thread", "gss--internal-init-sec-context-async");
+    bind_function(env, "gss--internal-init-sec-context-async", init_sec_context_async_fn);
+
+    emacs_value async_collect_fn = make_module_function(env, 0, 0, Fasync_collect, "collect the results of completed asynchronous operations", "gss--internal-async-collect");
+    bind_function(env, "gss--internal-async-collect", async_collect_fn);
+
+    emacs_value async_cancel_fn = make_module_function(env, 1, 1, Fasync_cancel, "cancel an asynchronous operation", "gss--internal-async-cancel");
+    bind_function(env, "gss--internal-async-cancel", async_cancel_fn);
+
+    emacs_value accept_many_fn = make_module_function(env, 3, 4, Faccept_many, "integrate gss_accept_sec_context on a vector of tokens", "gss--internal-accept-many");
+    bind_function(env, "gss--internal-accept-many", accept_many_fn);
+
+    emacs_value export_sec_context_fn = make_module_function(env, 1, 1, Fexport_sec_context, "integrates gss_export_sec_context", "gss--internal-export-sec-context");
+    bind_function(env, "gss--internal-export-sec-context", export_sec_context_fn);
+
+    emacs_value import_sec_context_fn = make_module_function(env, 1, 1, Fimport_sec_context, "integrates gss_import_sec_context", "gss--internal-import-sec-context");
+    bind_function(env, "gss--internal-import-sec-context", import_sec_context_fn);
+
+    emacs_value display_status_fn = make_module_function(env, 3, 3, Fdisplay_status, "integrates gss_display_status", "gss--internal-display-status");
+    bind_function(env, "gss--internal-display-status", display_status_fn);
+
+    emacs_value stats_fn = env->make_function(env, 0, 0, Fstats, "return the performance counters", NULL);
+    bind_function(env, "gss--internal-stats", stats_fn);
+
+    emacs_value stats_reset_fn = env->make_function(env, 0, 0, Fstats_reset, "reset the performance counters", NULL);
+    bind_function(env, "gss--internal-stats-reset", stats_reset_fn);
+
+    emacs_value negotiate_header_fn = make_module_function(env, 5, 6, Fnegotiate_header, "integrates gss_init_sec_context with SPNEGO and HTTP Negotiate headers", "gss--internal-negotiate-header");
+    bind_function(env, "gss--internal-negotiate-header", negotiate_header_fn);
+
+    emacs_value negotiate_accept_header_fn = make_module_function(env, 2, 3, Fnegotiate_accept_header, "integrates gss_accept_sec_context with HTTP Negotiate headers", "gss--internal-negotiate-accept-header");
+    bind_function(env, "gss--internal-negotiate-accept-header", negotiate_accept_header_fn);
+
+    emacs_value transport_new_fn = env->make_function(env, 1, 2, Ftransport_new, "create the receiving state of a protected transport", NULL);
+    bind_function(env, "gss--internal-transport-new", transport_new_fn);
+
+    emacs_value transport_unwrap_fn = make_module_function(env, 3, 3, Ftransport_unwrap, "unwrap the frames completed by data received on a transport", "gss--internal-transport-unwrap");
+    bind_function(env, "gss--internal-transport-unwrap", transport_unwrap_fn);
+
+    emacs_value transport_wrap_fn = make_module_function(env, 4, 4, Ftransport_wrap, "wrap and frame data to send on a transport", "gss--internal-transport-wrap");
+    bind_function(env, "gss--internal-transport-wrap", transport_wrap_fn);
+
+    emacs_value trace_start_fn = env->make_function(env, 2, 2, Ftrace_start, "start recording a token trace", NULL);
+    bind_function(env, "gss--internal-trace-start", trace_start_fn);
+
+    emacs_value trace_stop_fn = env->make_function(env, 0, 0, Ftrace_stop, "stop recording a token trace", NULL);
+    bind_function(env, "gss--internal-trace-stop", trace_stop_fn);
+
+    emacs_value trace_replay_fn = make_module_function(env, 3, 4, Ftrace_replay, "replay a token trace through an acceptor", "gss--internal-trace-replay");
+    bind_function(env, "gss--internal-trace-replay", trace_replay_fn);
+
+    emacs_value sasl_new_fn = env->make_function(env, 4, 4, Fsasl_new, "create a SASL GSSAPI client state", NULL);
+    bind_function(env, "gss--internal-sasl-new", sasl_new_fn);
+
+    emacs_value sasl_step_fn = make_module_function(env, 5, 5, Fsasl_step, "run one step of a SASL GSSAPI exchange", "gss--internal-sasl-step");
+    bind_function(env, "gss--internal-sasl-step", sasl_step_fn);
+
+    emacs_value sasl_info_fn = env->make_function(env, 1, 1, Fsasl_info, "return the result of a SASL GSSAPI exchange", NULL);
+    bind_function(env, "gss--internal-sasl-info", sasl_info_fn);
+
+    emacs_value pseudo_random_fn = make_module_function(env, 3, 4, Fpseudo_random, "integrates gss_pseudo_random", "gss--internal-pseudo-random");
+    bind_function(env, "gss--internal-pseudo-random", pseudo_random_fn);
+
+    emacs_value bulk_new_fn = make_module_function(env, 3, 3, Fbulk_new, "create a bulk channel keyed from a context", "gss--internal-bulk-new");
+    bind_function(env, "gss--internal-bulk-new", bulk_new_fn);
+
+    emacs_value bulk_encrypt_fn = make_module_function(env, 2, 2, Fbulk_encrypt, "encrypt and frame data to send on a bulk channel", "gss--internal-bulk-encrypt");
+    bind_function(env, "gss--internal-bulk-encrypt", bulk_encrypt_fn);
+
+    emacs_value bulk_decrypt_fn = make_module_function(env, 2, 2, Fbulk_decrypt, "decrypt the chunks completed by data received on a bulk channel", "gss--internal-bulk-decrypt");
+    bind_function(env, "gss--internal-bulk-decrypt", bulk_decrypt_fn);
+
+    emacs_value delete_sec_context_fn = make_module_function(env, 1, 1, Fdelete_sec_context, "integrates gss_delete_sec_context", "gss--internal-delete-sec-context");
+    bind_function(env, "gss--internal-delete-sec-context", delete_sec_context_fn);
+
+    emacs_value release_name_fn = make_module_function(env, 1, 1, Frelease_name, "integrates gss_release_name", "gss--internal-release-name");
+    bind_function(env, "gss--internal-release-name", release_name_fn);
+
+    emacs_value release_cred_fn = make_module_function(env, 1, 1, Frelease_cred, "integrates gss_release_cred", "gss--internal-release-cred");
+    bind_function(env, "gss--internal-release-cred", release_cred_fn);
+
+    emacs_value bench_intern_fn = env->make_function(env, 1, 1, Fbench_intern, "intern the symbols formerly looked up on every call", NULL);
+    bind_function(env, "gss--internal-bench-intern", bench_intern_fn);
+
+    emacs_value live_handles_fn = env->make_function(env, 0, 0, Flive_handles, "return the number of live handles", NULL);
+    bind_function(env, "gss--internal-live-handles", live_handles_fn);
+
+    emacs_value pool_stats_fn = env->make_function(env, 0, 0, Fpool_stats, "return the buffer pool counters", NULL);
+    bind_function(env, "gss--internal-pool-stats", pool_stats_fn);
+
+    emacs_value set_pool_limit_fn = env->make_function(env, 1, 1, Fset_pool_limit, "set the buffer pool cache limit", NULL);
+    bind_function(env, "gss--internal-set-pool-limit", set_pool_limit_fn);
 
     provide_module(env, "emacs-gssapi");
 